@@ -21,93 +21,831 @@
  */
 
 #include "inc/oscar.h"
+#include "leanXmotion.h"
 #include "leanXalgos.h"
+#include "leanXtools.h"
+#include "leanXpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Kernel core
+ * All fastdebayer* functions make one pixel out of a 2x2 Bayer cell and
+ * walk the raw frame two rows at a time: the even row holds B G B G..., the
+ * odd row G R G R... They are generated from one row kernel, debayer_row(),
+ * which gets the output format as a compile time constant: the colour
+ * transform and the packing of every format is a case of a switch that the
+ * compiler folds away, so every format runs the same inner loop.
+ *
+ * Where the rows and the output are word aligned, the kernel loads 32-bit 
+ * words and handles two pixels per word with SIMD-within-a-register: the 
+ * colour values of two pixels sit in the two 16-bit lanes of a word (SWAR),
+ * every lane stays below 0x10000 during the fixed-point transforms and the
+ * results are packed into whole output words. The rest of a row is done 
+ * pixel by pixel. The SWAR path assumes a little endian CPU as the 
+ * leanXcam.
+ * The YUV formats take Y, U and V from the contribution tables of the 
+ * selected colour matrix, see yuv_tables_init(), the luminance of the 
+ * statistics and of the grey output of FMT_BGRGREY uses the fixed 7-bit 
+ * weights of LUMA().
+ *
+ * A new format needs an entry in enum debayer_format and Debayer_Formats,
+ * a case in pack_words() and in pack_pixel() and a wrapper function.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	#define DEBAYER_SWAR
+#endif
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+enum debayer_format {
+	FMT_BGR,
+	FMT_RGB,
+	FMT_BGRGREY,	/* BGR to out and luminance to grey */
+	FMT_YUV444,
+	FMT_YUV422,
+	FMT_GREY,
+	FMT_CHROMU,
+	FMT_CHROMV,
+	FMT_I420,	/* Y plane to out, U and V planes follow */
+	FMT_NV12,	/* Y plane to out, an interleaved UV plane follows */
+	FMT_LUMA	/* the grey of FMT_BGRGREY to out */
+};
+
+/* Planar 4:2:0 formats, the row kernel writes their Y plane */
+#define PLANAR420(fmt) ((fmt) == FMT_I420 || (fmt) == FMT_NV12)
+
+/* Per format: picture type, output bytes per pixel, whether the mean is
+ * taken over R+G+B (else over Y), whether Y comes from the YUV tables */
+static const struct {
+	enum EnOscPictureType type;
+	int bpp;
+	bool rgbmean;
+	bool yuv;
+} Debayer_Formats[] = {
+	[FMT_BGR]     = { OSC_PICTURE_BGR_24,    3, TRUE,  FALSE },
+	[FMT_RGB]     = { OSC_PICTURE_RGB_24,    3, TRUE,  FALSE },
+	[FMT_BGRGREY] = { OSC_PICTURE_BGR_24,    3, TRUE,  FALSE },
+	[FMT_YUV444]  = { OSC_PICTURE_YUV_444,   3, FALSE, TRUE },
+	[FMT_YUV422]  = { OSC_PICTURE_YUV_422,   2, FALSE, TRUE },
+	[FMT_GREY]    = { OSC_PICTURE_GREYSCALE, 1, FALSE, TRUE },
+	[FMT_CHROMU]  = { OSC_PICTURE_CHROM_U,   1, FALSE, TRUE },
+	[FMT_CHROMV]  = { OSC_PICTURE_CHROM_V,   1, FALSE, TRUE },
+	[FMT_I420]    = { OSC_PICTURE_GREYSCALE, 1, FALSE, TRUE },
+	[FMT_NV12]    = { OSC_PICTURE_GREYSCALE, 1, FALSE, TRUE },
+	[FMT_LUMA]    = { OSC_PICTURE_GREYSCALE, 1, FALSE, FALSE },
+};
+
+#define LANES 0x00ff00ff
+
+/* Y = 0.299*R+0.587*G+0.114*B), Faktoren * 128 */
+#define LUMA(R,G,B) ((38*(R) + 75*(G) + 15*(B)) >> 7)
+#define SWAR_LUMA(R,G,B) (LUMA(R,G,B) & LANES)
+
+/* Contribution tables of the YUV transform, one per colour and output 
+ * channel, in 16.16 fixed point. The offset and the rounding are in the 
+ * table of blue for Y and of green for U and V, so every value is three 
+ * lookups, two adds and a shift. The B of U and the R of V are both 0.5 in
+ * every matrix and share one table. */
+static struct {
+	int32 yr[256], yg[256], yb[256];
+	int32 ur[256], ug[256], ub[256];
+	int32 vg[256], vb[256];
+	bool ready;
+} Yuv;
+
+#define YUV_Y(R,G,B) ((Yuv.yr[R] + Yuv.yg[G] + Yuv.yb[B]) >> 16)
+/* A full range chroma value of exactly 255.5 rounds up, the only one */
+#define YUV_U(R,G,B) min255((Yuv.ur[R] + Yuv.ug[G] + Yuv.ub[B]) >> 16)
+#define YUV_V(R,G,B) min255((Yuv.ub[R] + Yuv.vg[G] + Yuv.vb[B]) >> 16)
+/* Y, U or V of both 16-bit lanes of SWAR words */
+#define YUV_LANES(F,R,G,B) (F((R) & 0xff, (G) & 0xff, (B) & 0xff) | \
+			    F((R) >> 16, (G) >> 16, (B) >> 16) << 16)
+
+static ALWAYS_INLINE int32 min255(int32 v)
+{
+	return v > 255 ? 255 : v;
+}
+
+/* Rounds to the nearest 16.16 fixed point value, without libm */
+static int32 fix16(double v)
+{
+	v *= 65536.0;
+	return (int32)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+/* yuv_tables_init
+ * Builds the contribution tables of the YUV formats for a colour matrix
+ * and range: YUV_BT601 (SD, JPEG) or YUV_BT709 (HD), YUV_FULL_RANGE 
+ * (0..255 for Y, U and V as in JPEG) or YUV_LIMITED_RANGE (16..235 for Y 
+ * and 16..240 for U and V as in video). U and V are Cb and Cr. Without a
+ * call the first YUV picture builds the tables for BT.601, full range; 
+ * call it before YUV formats run on several threads.
+ */
+void yuv_tables_init(enum yuv_matrix matrix, enum yuv_range range)
+{
+	const double kr = matrix == YUV_BT709 ? 0.2126 : 0.299;
+	const double kb = matrix == YUV_BT709 ? 0.0722 : 0.114;
+	const double kg = 1.0 - kr - kb;
+	const double ys = range == YUV_LIMITED_RANGE ? 219.0/255.0 : 1.0;
+	const double cs = range == YUV_LIMITED_RANGE ? 224.0/255.0 : 1.0;
+	const double yoff = range == YUV_LIMITED_RANGE ? 16.0 : 0.0;
+	const double cu = cs/(2.0*(1.0 - kb)), cv = cs/(2.0*(1.0 - kr));
+	int v;
+
+	for (v=0; v<256; v++) {
+		Yuv.yr[v] = fix16(ys*kr*v);
+		Yuv.yg[v] = fix16(ys*kg*v);
+		Yuv.yb[v] = fix16(ys*kb*v + yoff + 0.5);
+		Yuv.ur[v] = fix16(-cu*kr*v);
+		Yuv.ug[v] = fix16(-cu*kg*v + 128.5);
+		Yuv.ub[v] = fix16(cs*0.5*v);
+		Yuv.vg[v] = fix16(-cv*kg*v + 128.5);
+		Yuv.vb[v] = fix16(-cv*kb*v);
+	}
+	Yuv.ready = TRUE;
+} /* yuv_tables_init */
+
+/* Adds the two lanes of a SWAR word */
+#define LANESUM(w) (((w) & 0xffff) + ((w) >> 16))
+
+/* Packs the lanes of 4 pixels of three colour planes (a = pixels 0,1 and
+ * b = pixels 2,3) into three words of 24-bit pixels X Y Z */
+static ALWAYS_INLINE void pack3(uint32 *out, uint32 Xa, uint32 Ya, 
+				uint32 Za, uint32 Xb, uint32 Yb, uint32 Zb)
+{
+	out[0] = (Xa & 0xff) | (Ya & 0xff) << 8 | (Za & 0xff) << 16 | 
+		 (Xa >> 16) << 24;
+	out[1] = (Ya >> 16) | (Za >> 16) << 8 | (Xb & 0xff) << 16 | 
+		 (Yb & 0xff) << 24;
+	out[2] = (Zb & 0xff) | (Xb >> 16) << 8 | (Yb >> 16) << 16 |
+		 (Zb >> 16) << 24;
+}
+
+/* Packs the lanes of 4 pixels of one plane into one word */
+#define PACK1(a,b) ((((a) | (a) >> 8) & 0xffff) | ((b) | (b) >> 8) << 16)
+
+/* pack_words
+ * Transforms and stores 4 pixels, given as the colour lanes of pixels 0,1
+ * (a) and 2,3 (b). If direct is set, e and o are the raw words of the 
+ * even and odd row in the B G / G R phase with one green and BGR is packed
+ * straight from them. Returns the contribution to the row sum. 
+ */
+static ALWAYS_INLINE uint32 pack_words(uint32 *w, uint32 *g, 
+				       const uint32 *e, const uint32 *o,
+				       uint32 Ra, uint32 Ga, uint32 Ba, 
+				       uint32 Rb, uint32 Gb, uint32 Bb,
+				       const bool direct,
+				       const enum debayer_format fmt)
+{
+	const bool yuv = Debayer_Formats[fmt].yuv;
+	const uint32 Ya = yuv ? YUV_LANES(YUV_Y, Ra, Ga, Ba) : 
+		SWAR_LUMA(Ra, Ga, Ba);
+	const uint32 Yb = yuv ? YUV_LANES(YUV_Y, Rb, Gb, Bb) :
+		SWAR_LUMA(Rb, Gb, Bb);
+
+	switch (fmt) {
+	case FMT_BGRGREY:
+		g[0] = PACK1(Ya, Yb);
+		/* fall through */
+	case FMT_BGR:
+		if (direct) {
+			/* The B G pairs of the even row already have the 
+			 * output order */
+			w[0] = (e[0] & 0xffff) | (o[0] & 0xff00) << 8 | 
+			       (e[0] & 0xff0000) << 8;
+			w[1] = (e[0] >> 24) | (o[0] >> 16 & 0xff00) | e[1] << 16;
+			w[2] = (o[1] >> 8 & 0xff) | (e[1] >> 8 & 0xffff00) | 
+			       (o[1] & 0xff000000);
+		} else {
+			pack3(w, Ba, Ga, Ra, Bb, Gb, Rb);
+		}
+		return LANESUM(Ra + Ga + Ba) + LANESUM(Rb + Gb + Bb);
+	case FMT_RGB:
+		pack3(w, Ra, Ga, Ba, Rb, Gb, Bb);
+		return LANESUM(Ra + Ga + Ba) + LANESUM(Rb + Gb + Bb);
+	case FMT_YUV444:
+		pack3(w, Ya, YUV_LANES(YUV_U, Ra, Ga, Ba), 
+		      YUV_LANES(YUV_V, Ra, Ga, Ba), Yb, 
+		      YUV_LANES(YUV_U, Rb, Gb, Bb), YUV_LANES(YUV_V, Rb, Gb, Bb));
+		break;
+	case FMT_YUV422:
+		/* UYVY, U and V are taken from the first pixel of a pair */
+		w[0] = YUV_U(Ra & 0xff, Ga & 0xff, Ba & 0xff) | Ya << 8 | 
+		       YUV_V(Ra & 0xff, Ga & 0xff, Ba & 0xff) << 16;
+		w[1] = YUV_U(Rb & 0xff, Gb & 0xff, Bb & 0xff) | Yb << 8 | 
+		       YUV_V(Rb & 0xff, Gb & 0xff, Bb & 0xff) << 16;
+		break;
+	case FMT_GREY:
+	case FMT_I420:
+	case FMT_NV12:
+	case FMT_LUMA:
+		w[0] = PACK1(Ya, Yb);
+		break;
+	case FMT_CHROMU:
+		w[0] = PACK1(YUV_LANES(YUV_U, Ra, Ga, Ba), 
+			     YUV_LANES(YUV_U, Rb, Gb, Bb));
+		break;
+	case FMT_CHROMV:
+		w[0] = PACK1(YUV_LANES(YUV_V, Ra, Ga, Ba), 
+			     YUV_LANES(YUV_V, Rb, Gb, Bb));
+		break;
+	}
+	return LANESUM(Ya + Yb);
+}
+
+/* pack_pixel
+ * Transforms and stores pixel i of a row. Returns the contribution to the 
+ * row sum. 
+ */
+static ALWAYS_INLINE uint32 pack_pixel(uint8 *out, uint8 *grey, int i, 
+				       int16 R, int16 G, int16 B, 
+				       const enum debayer_format fmt)
+{
+	const int16 Y = Debayer_Formats[fmt].yuv ? YUV_Y(R, G, B) : 
+		LUMA(R, G, B);
+
+	switch (fmt) {
+	case FMT_BGRGREY:
+		grey[i] = Y;
+		/* fall through */
+	case FMT_BGR:
+		out[3*i]   = B;
+		out[3*i+1] = G;
+		out[3*i+2] = R;
+		return R + G + B;
+	case FMT_RGB:
+		out[3*i]   = R;
+		out[3*i+1] = G;
+		out[3*i+2] = B;
+		return R + G + B;
+	case FMT_YUV444:
+		out[3*i]   = Y;
+		out[3*i+1] = YUV_U(R, G, B);
+		out[3*i+2] = YUV_V(R, G, B);
+		break;
+	case FMT_YUV422:
+		if ((i & 1) == 0) {
+			out[2*i]   = YUV_U(R, G, B);
+			out[2*i+2] = YUV_V(R, G, B);
+		}
+		out[2*i+1] = Y;
+		break;
+	case FMT_GREY:
+	case FMT_I420:
+	case FMT_NV12:
+	case FMT_LUMA:
+		out[i] = Y;
+		break;
+	case FMT_CHROMU:
+		out[i] = YUV_U(R, G, B);
+		break;
+	case FMT_CHROMV:
+		out[i] = YUV_V(R, G, B);
+		break;
+	}
+	return Y;
+}
+
+/* Channel sums of the statistics */
+struct row_sums {
+	uint32 r, g, b, y;
+};
+
+
+/* debayer_row
+ * Converts one row pair to n output pixels, the first nw of them (a 
+ * multiple of 4, 0 if the rows are not aligned) may be done word by word.
+ * brow is the row with the blue samples, at bit shift bshift (0 or 8) in
+ * the 16-bit lanes, rrow the row with the red samples at the other shift.
+ * bin averages both greens of a cell, else the green next to blue is 
+ * taken. grey is only used by FMT_BGRGREY. If gather is set, the channel
+ * sums are added to rs and, if luma is not NULL, the luminance of the 
+ * row is stored there. Returns the row sum for the mean.
+ */
+static ALWAYS_INLINE uint32 debayer_row(const uint8 *brow, const uint8 *rrow,
+					uint8 *out, uint8 *grey, int n, int nw,
+					const int bshift, const bool bin,
+					const bool gather, struct row_sums *rs,
+					uint8 *luma, 
+					const enum debayer_format fmt)
+{
+	const int bpp = Debayer_Formats[fmt].bpp;
+	const int rshift = 8 - bshift;
+	const int bc = bshift >> 3;
+	int i=0;
+	uint32 sum=0;
+	int16 R, G, B, Y;
+
+#if defined(DEBAYER_SWAR)
+	{
+		const uint32 *e = (const uint32 *)(brow + 2*i);
+		const uint32 *o = (const uint32 *)(rrow + 2*i);
+		uint32 *w = (uint32 *)(out + bpp*i);
+		uint32 Ra, Ga, Ba, Rb, Gb, Bb, Ya, Yb;
+
+		for (; i<nw; i+=4, e+=2, o+=2, w+=bpp) {
+			Ba = e[0] >> bshift & LANES; 
+			Ga = e[0] >> rshift & LANES;
+			Ra = o[0] >> rshift & LANES;
+			Bb = e[1] >> bshift & LANES; 
+			Gb = e[1] >> rshift & LANES;
+			Rb = o[1] >> rshift & LANES;
+			if (bin) {
+				Ga = (Ga + (o[0] >> bshift & LANES) + 0x00010001) 
+					>> 1 & LANES;
+				Gb = (Gb + (o[1] >> bshift & LANES) + 0x00010001) 
+					>> 1 & LANES;
+			}
+			sum += pack_words(w, fmt == FMT_BGRGREY ? 
+					  (uint32 *)(grey + i) : 0, e, o,
+					  Ra, Ga, Ba, Rb, Gb, Bb, !bin, fmt);
+			if (gather) {
+				Ya = SWAR_LUMA(Ra, Ga, Ba);
+				Yb = SWAR_LUMA(Rb, Gb, Bb);
+				rs->r += LANESUM(Ra + Rb);
+				rs->g += LANESUM(Ga + Gb);
+				rs->b += LANESUM(Ba + Bb);
+				rs->y += LANESUM(Ya + Yb);
+				if (luma != 0)
+					*(uint32 *)(luma + i) = PACK1(Ya, Yb);
+			}
+		}
+	}
+#endif
+	/* UYVY is only written for whole pixel pairs */
+	if (fmt == FMT_YUV422)
+		n &= ~1;
+	for (; i<n; i++) {
+		R = rrow[2*i+1-bc];
+		G = brow[2*i+1-bc];
+		B = brow[2*i+bc];
+		if (bin)
+			G = (G + rrow[2*i+bc] + 1) >> 1;
+		sum += pack_pixel(out, grey, i, R, G, B, fmt);
+		if (gather) {
+			Y = LUMA(R, G, B);
+			rs->r += R;
+			rs->g += G;
+			rs->b += B;
+			rs->y += Y;
+			if (luma != 0)
+				luma[i] = Y;
+		}
+	}
+	return sum;
+}
+
+/* stats_row
+ * Adds the luminance row row of rows to the statistics asked for in
+ * stats->want which are not gathered by the row kernel itself. Every 
+ * pixel is read once, for all wanted statistics at once. With a histogram
+ * min and max are taken from it at the end of the pass.
+ */
+static void stats_row(struct ImgStats *stats, const uint8 *luma, int n,
+		      int row, int rows)
+{
+	const int want = stats->want;
+	const int tiles = (want & STATS_TILES) ? stats->tiles_x : 1;
+	uint32 *tile = stats->tiles + row*stats->tiles_y/rows*stats->tiles_x;
+	uint32 *hist = stats->hist;
+	int i, tx, to, v;
+	int lo = stats->min_y, hi = stats->max_y;
+	uint32 sum;
+
+	for (tx=0, i=0; tx<tiles; tx++) {
+		to = (tx+1)*n/tiles;
+		sum = 0;
+		if (want & STATS_HIST) {
+			for (; i<to; i++) {
+				v = luma[i];
+				hist[v]++;
+				sum += v;
+			}
+		} else if (want & STATS_MINMAX) {
+			for (; i<to; i++) {
+				v = luma[i];
+				if (v < lo)
+					lo = v;
+				if (v > hi)
+					hi = v;
+				sum += v;
+			}
+		} else {
+			for (; i<to; i++)
+				sum += luma[i];
+		}
+		if (want & STATS_TILES)
+			tile[tx] += sum;
+	}
+	stats->min_y = lo;
+	stats->max_y = hi;
+}
+
+/* Takes min and max of the luminance from the histogram */
+static void stats_end(struct ImgStats *stats)
+{
+	int v;
+
+	if ((stats->want & (STATS_HIST | STATS_MINMAX)) != 
+	    (STATS_HIST | STATS_MINMAX))
+		return;
+	for (v=0; v<255 && stats->hist[v] == 0; v++)
+		;
+	stats->min_y = v;
+	for (v=255; v>0 && stats->hist[v] == 0; v--)
+		;
+	stats->max_y = v;
+}
+
+/* Clears the statistics of a new pass */
+static void stats_begin(struct ImgStats *stats)
+{
+	stats->sum = stats->count = stats->pixels = 0;
+	stats->sum_r = stats->sum_g = stats->sum_b = stats->sum_y = 0;
+	stats->mean_r = stats->mean_g = stats->mean_b = stats->mean_y = 0;
+	stats->min_y = 255;
+	stats->max_y = 0;
+	if (stats->want & STATS_HIST)
+		memset(stats->hist, 0, sizeof(stats->hist));
+	if (stats->want & STATS_TILES) {
+		stats->tiles_x = max(1, min(stats->tiles_x, STATS_MAX_TILES_X));
+		stats->tiles_y = max(1, min(stats->tiles_y, STATS_MAX_TILES_Y));
+		memset(stats->tiles, 0, sizeof(stats->tiles));
+	}
+}
+
+/* Rounded mean of sum over count values */
+#define ROUND_MEAN(sum, count) (((sum) + (count)/2) / (count))
+
+/* Computes the means from the sums of a pass */
+static void stats_finish(struct ImgStats *stats)
+{
+	const uint32 pixels = stats->pixels;
+
+	if (pixels == 0)
+		return;
+	stats->mean = ROUND_MEAN(stats->sum, stats->count);
+	if (stats->want & ~STATS_MEAN) {
+		stats_end(stats);
+		stats->mean_r = ROUND_MEAN(stats->sum_r, pixels);
+		stats->mean_g = ROUND_MEAN(stats->sum_g, pixels);
+		stats->mean_b = ROUND_MEAN(stats->sum_b, pixels);
+		stats->mean_y = ROUND_MEAN(stats->sum_y, pixels);
+	}
+}
+
+/* Bayer order of the row y from column x on of a frame whose first row
+ * has the order order */
+static enum EnBayerOrder bayer_order_at(enum EnBayerOrder order, int x, int y)
+{
+	if (x & 1)
+		order = order == ROW_BGBG ? ROW_GBGB : 
+			order == ROW_GBGB ? ROW_BGBG :
+			order == ROW_RGRG ? ROW_GRGR : ROW_RGRG;
+	if (y & 1)
+		order = order == ROW_BGBG ? ROW_GRGR : 
+			order == ROW_GRGR ? ROW_BGBG :
+			order == ROW_GBGB ? ROW_RGRG : ROW_GBGB;
+	return order;
+}
+
+/* chroma420_row
+ * Chroma of the planar 4:2:0 formats from a row pair with the phases of 
+ * debayer_row(): the first output row of a chroma row stores the colour 
+ * sums of its pixel pairs in acc, the second adds its own and stores U 
+ * and V of the 2x2 means at u and v, step bytes apart. The pixels are the
+ * ones of the Y plane, with both greens averaged if bin is set.
+ */
+static ALWAYS_INLINE void chroma420_row(const uint8 *brow, const uint8 *rrow,
+					int n, const int bshift, 
+					const bool bin, uint16 *acc, 
+					const bool second, uint8 *u, uint8 *v,
+					const int step)
+{
+	const int bc = bshift >> 3;
+	int i, j, g, R, G, B;
+
+	for (i=0; i+1<n; i+=2, acc+=3) {
+		R = G = B = 0;
+		for (j=i; j<i+2; j++) {
+			R += rrow[2*j+1-bc];
+			B += brow[2*j+bc];
+			g = brow[2*j+1-bc];
+			if (bin)
+				g = (g + rrow[2*j+bc] + 1) >> 1;
+			G += g;
+		}
+		if (!second) {
+			acc[0] = R;
+			acc[1] = G;
+			acc[2] = B;
+			continue;
+		}
+		R = (R + acc[0] + 2) >> 2;
+		G = (G + acc[1] + 2) >> 2;
+		B = (B + acc[2] + 2) >> 2;
+		u[i/2*step] = YUV_U(R, G, B);
+		v[i/2*step] = YUV_V(R, G, B);
+	}
+}
+
+/* debayer_pass
+ * Runs the row kernel of a format over the output rows y0 to y1-1 of the
+ * window v of the raw frame, all of them unless the window is split in 
+ * bands. The window is read in place, the output pictures are v->w/2 by 
+ * v->h/2 pixels. If the format has a grey output or a Y plane, the rows 
+ * written to it are fed into the integral image ii if that is not NULL. 
+ * The planar 4:2:0 formats take the chroma of two output rows at a time,
+ * their bands have to start on even rows. order is the 
+ * Bayer order of the first row of the frame, it is normalised to the row
+ * holding blue and the bit shift of blue within a 16-bit lane; red is 
+ * always in the other row at the other shift.
+ * With gather set, the statistics in stats->want are taken in the same 
+ * pass: channel sums in the kernel, the rest from the luminance row while
+ * it is still in the cache. The statistics cover the rows of the pass.
+ */
+static ALWAYS_INLINE int debayer_pass(const struct OSC_PICTURE *pRaw, 
+				      const struct pic_view *v,
+				      struct OSC_PICTURE *pOut, 
+				      struct OSC_PICTURE *pGrey, 
+				      struct integral *ii,
+				      struct ImgStats *stats, 
+				      enum EnBayerOrder order, 
+				      const bool bin, const bool gather,
+				      const int y0, const int y1,
+				      const enum debayer_format fmt)
+{
+	int y;
+	const int stride = v->stride;
+	const int n = v->w/2;
+	const int bpp = Debayer_Formats[fmt].bpp;
+	const int div = Debayer_Formats[fmt].rgbmean ? 3 : 1;
+	const uint8 *even = pic_view_row(pRaw, v, 0);
+	uint8 *out = (uint8 *)pOut->data;
+	uint8 *grey = fmt == FMT_BGRGREY ? (uint8 *)pGrey->data : 0;
+	int bodd, bshift;
+	const int rows = v->h/2;
+	const uint32 pixels = n*(y1 - y0);
+	uint32 sum=0;
+	int nw = 0;
+	struct row_sums rs = { 0, 0, 0, 0 };
+	/* The luminance row of the statistics if the format has none */
+	uint32 lumarow[OSC_CAM_MAX_IMAGE_WIDTH/2/4];
+	const bool ownluma = (fmt == FMT_GREY || fmt == FMT_BGRGREY ||
+			      fmt == FMT_LUMA || PLANAR420(fmt));
+	/* The chroma planes and the colour sums of the pixel pairs */
+	uint8 *u = 0, *cv = 0;
+	const int cstride = fmt == FMT_NV12 ? 2*(n/2) : n/2;
+	const int cstep = fmt == FMT_NV12 ? 2 : 1;
+	uint16 acc[3*OSC_CAM_MAX_IMAGE_WIDTH/4];
+
+	order = bayer_order_at(order, v->x, v->y);
+	bodd = (order == ROW_RGRG || order == ROW_GRGR) ? stride : 0;
+	bshift = (order == ROW_GBGB || order == ROW_RGRG) ? 8 : 0;
+
+	/* Word access needs aligned rows in every buffer, also for the 
+	 * 3 bytes per pixel formats */
+	if (((uintptr_t)even | (uintptr_t)out | (uintptr_t)grey | stride) % 4 
+	    == 0 && v->w % 8 == 0)
+		nw = n;
+	if (PLANAR420(fmt)) {
+		if (n > OSC_CAM_MAX_IMAGE_WIDTH/2 || (y0 & 1))
+			return -1;
+		u = out + n*rows + y0/2*cstride;
+		cv = fmt == FMT_NV12 ? u + 1 : u + (n/2)*(rows/2);
+	}
+	if (stats != 0)
+		stats_begin(stats);
+
+	even += 2*y0*stride;
+	out  += y0*bpp*n;
+	if (fmt == FMT_BGRGREY)
+		grey += y0*n;
+	for (y=2*y0; y<2*y1; y+=2) {
+		sum += debayer_row(even + bodd, even + stride - bodd, out, grey,
+				   n, nw, bshift, bin, gather, &rs, 
+				   ownluma ? 0 : (uint8 *)lumarow, fmt);
+		if (gather)
+			stats_row(stats, (fmt == FMT_GREY || fmt == FMT_LUMA ||
+					  PLANAR420(fmt)) ?
+				  out : (fmt == FMT_BGRGREY ? grey : 
+					 (uint8 *)lumarow), n, y/2, rows);
+		if (PLANAR420(fmt)) {
+			if ((y & 2) == 0) {
+				chroma420_row(even + bodd, even + stride - bodd,
+					      n, bshift, bin, acc, FALSE, 
+					      0, 0, cstep);
+			} else {
+				chroma420_row(even + bodd, even + stride - bodd,
+					      n, bshift, bin, acc, TRUE, 
+					      u, cv, cstep);
+				u  += cstride;
+				cv += cstride;
+			}
+			if (ii != 0)
+				integral_addrow(ii, out);
+		}
+		if ((fmt == FMT_LUMA || fmt == FMT_GREY) && ii != 0)
+			integral_addrow(ii, out);
+		even += 2*stride;
+		out  += bpp*n;
+		if (fmt == FMT_BGRGREY) {
+			if (ii != 0)
+				integral_addrow(ii, grey);
+			grey += n;
+		}
+	}
+	/* Only the first band describes the pictures */
+	if (y0 == 0) {
+		pOut->width  = n;
+		pOut->height = rows; 
+		pOut->type  = Debayer_Formats[fmt].type;
+		if (fmt == FMT_BGRGREY) {
+			pGrey->width  = n;
+			pGrey->height = rows; 
+			pGrey->type  = OSC_PICTURE_GREYSCALE;
+		}
+	}
+
+	if (stats != 0) {
+		stats->sum = sum;
+		stats->count = pixels*div;
+		stats->pixels = pixels;
+		stats->sum_r = rs.r;
+		stats->sum_g = rs.g;
+		stats->sum_b = rs.b;
+		stats->sum_y = rs.y;
+		stats_finish(stats);
+	}
+	return 0;
+}
+
+/* debayer_band
+ * Runs debayer_pass() on band band of bands of the output rows of the 
+ * window view of the raw frame (the whole frame if view is NULL), with 
+ * the statistics gathering compiled in only if more than the mean is 
+ * asked for.
+ */
+static ALWAYS_INLINE int debayer_band(const struct OSC_PICTURE *pRaw, 
+				      const struct pic_view *view,
+				      struct OSC_PICTURE *pOut, 
+				      struct OSC_PICTURE *pGrey, 
+				      struct integral *ii,
+				      struct ImgStats *stats, 
+				      const enum EnBayerOrder order, 
+				      const bool bin, int band, int bands,
+				      const enum debayer_format fmt)
+{
+	struct pic_view v;
+	int y0, y1;
+
+	if (Debayer_Formats[fmt].yuv && !Yuv.ready)
+		yuv_tables_init(YUV_BT601, YUV_FULL_RANGE);
+	pic_view_clip(&v, pRaw, view);
+	y0 = BAND_FIRST(v.h/2, band, bands);
+	y1 = BAND_FIRST(v.h/2, band+1, bands);
+
+	if (stats != 0 && (stats->want & ~STATS_MEAN) != 0 &&
+	    v.w <= OSC_CAM_MAX_IMAGE_WIDTH)
+		return debayer_pass(pRaw, &v, pOut, pGrey, ii, stats, order, 
+				    bin, TRUE, y0, y1, fmt);
+	return debayer_pass(pRaw, &v, pOut, pGrey, ii, stats, order, bin, 
+			    FALSE, y0, y1, fmt);
+}
+
+/* Runs debayer_pass() on the whole window */
+static ALWAYS_INLINE int debayer(const struct OSC_PICTURE *pRaw, 
+				 const struct pic_view *view,
+				 struct OSC_PICTURE *pOut, 
+				 struct OSC_PICTURE *pGrey, struct integral *ii,
+				 struct ImgStats *stats, 
+				 const enum EnBayerOrder order, const bool bin,
+				 const enum debayer_format fmt)
+{
+	return debayer_band(pRaw, view, pOut, pGrey, ii, stats, order, bin, 
+			    0, 1, fmt);
+}
 
 /* fastdebayerBGR
  * Very simple debayering. Makes one colour pixel out of 4 bayered pixels
  * This means that the resulting image is only width/2 by height/2 pixels
  * Image size is reduced by a factor of 4!
- * This needs about 6ms for a full 750x480 frame on leanXcam
  * And returns the image in BGR24 Format
  */
 int fastdebayerBGR(const struct OSC_PICTURE pRaw, 
 		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
 {
-	uint16 x,y;
-	uint32 outPos=0;
-	unsigned char *in  = (unsigned char *)pRaw.data;
-	unsigned char *out = (unsigned char *)pOut->data;
-	uint32 mean=0;
-	uint32 rowmean;
-	uint16 R1, G1, B1;
-
-	for (y=0; y<pRaw.height; y+=2) {
-		rowmean=0;
-		for (x=0; x<pRaw.width; x+=2) {
-			R1 = (unsigned char)in[(y+1)*pRaw.width+x+1];
-			G1 = (unsigned char)in[y*pRaw.width+x+1];
-			B1 = (unsigned char)in[y*pRaw.width+x];
-			/* Blue */
-			out[outPos++]=B1;
-			/* Green */
-			out[outPos++]=G1;
-			/* Red */
-			out[outPos++]=R1;
-			rowmean = rowmean + R1 +G1 +B1;
-		} /* for x */
-		mean = mean + (rowmean / (pRaw.width/2) / 3);
-	} /* for y */
-	pOut->width  = pRaw.width/2;
-	pOut->height = pRaw.height/2; 
-	pOut->type  = OSC_PICTURE_BGR_24;
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_BGR);
+} /* fastdebayer */
 
-	if (stats != 0) {
-		stats->mean = mean / (pRaw.height / 2);
+/* fastdebayerBGRGrey
+ * Fused pipeline pass: one sweep over the raw frame produces the BGR24 
+ * picture of fastdebayerBGR() in pOut, a luminance picture in pGrey (with
+ * the 7-bit weights of the statistics, not the YUV tables) and, if ii is 
+ * not NULL, feeds the luminance rows into the integral image used for the
+ * motion tile sums. ii has to be prepared for
+ * a width/2 x height/2 picture, see motion_integral().
+ * The raw frame is therefore only read once per loop.
+ */
+int fastdebayerBGRGrey(const struct OSC_PICTURE pRaw, 
+		struct OSC_PICTURE *pOut, struct OSC_PICTURE *pGrey, 
+		struct integral *ii, struct ImgStats *stats) 
+{
+	return debayer(&pRaw, 0, pOut, pGrey, ii, stats, ROW_BGBG, FALSE, 
+		       FMT_BGRGREY);
+} /* fastdebayerBGRGrey */
+
+/* fastbinBGR
+ * 2x2 binning: makes one colour pixel out of 4 bayered pixels like
+ * fastdebayerBGR() but averages both green samples of a cell, which gives
+ * less noise in green and in the luminance. order is the Bayer order of 
+ * the first row, see OscCamGetBayerOrder(); it changes with the sensor
+ * perspective and the colours stay right without a correction pass.
+ * Only the window view of the raw frame is debayered, in place and with 
+ * the colours of its own Bayer phase, or the whole frame if view is NULL.
+ * Returns the image in BGR24 Format
+ */
+int fastbinBGR(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+	       struct OSC_PICTURE *pOut, enum EnBayerOrder order, 
+	       struct ImgStats *stats) 
+{
+	return debayer(&pRaw, view, pOut, 0, 0, stats, order, TRUE, FMT_BGR);
+} /* fastbinBGR */
+
+/* fastbinBGRGrey
+ * The fused pipeline pass of fastdebayerBGRGrey() with the binning and
+ * Bayer order and window of fastbinBGR(). ii has to be prepared for the 
+ * size of the window.
+ */
+int fastbinBGRGrey(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pOut, struct OSC_PICTURE *pGrey, 
+		struct integral *ii, enum EnBayerOrder order, 
+		struct ImgStats *stats) 
+{
+	return debayer(&pRaw, view, pOut, pGrey, ii, stats, order, TRUE, 
+		       FMT_BGRGREY);
+} /* fastbinBGRGrey */
+
+/* fastbinBGRGreyBand
+ * fastbinBGRGrey() for the output rows of band band of bands only, without
+ * the integral image. The bands of a frame can run in parallel, each with
+ * its own stats; stats_merge() adds them up to the statistics of the 
+ * frame. The pictures are described by band 0.
+ */
+int fastbinBGRGreyBand(const struct OSC_PICTURE pRaw, 
+		const struct pic_view *view,
+		struct OSC_PICTURE *pOut, struct OSC_PICTURE *pGrey, 
+		enum EnBayerOrder order, struct ImgStats *stats, 
+		int band, int bands) 
+{
+	return debayer_band(&pRaw, view, pOut, pGrey, 0, stats, order, TRUE, 
+			    band, bands, FMT_BGRGREY);
+} /* fastbinBGRGreyBand */
+
+/* stats_merge
+ * Merges the statistics of the n bands of a frame into stats, which has
+ * the same want and tile grid as the bands. Only integer sums, minima and
+ * maxima are merged, the result does not depend on the number of bands.
+ */
+void stats_merge(struct ImgStats *stats, const struct ImgStats *bands, int n)
+{
+	const struct ImgStats *b;
+	int i;
+
+	stats_begin(stats);
+	for (b=bands; b<bands+n; b++) {
+		stats->sum += b->sum;
+		stats->count += b->count;
+		stats->pixels += b->pixels;
+		stats->sum_r += b->sum_r;
+		stats->sum_g += b->sum_g;
+		stats->sum_b += b->sum_b;
+		stats->sum_y += b->sum_y;
+		stats->min_y = min(stats->min_y, b->min_y);
+		stats->max_y = max(stats->max_y, b->max_y);
+		if (stats->want & STATS_HIST)
+			for (i=0; i<256; i++)
+				stats->hist[i] += b->hist[i];
+		if (stats->want & STATS_TILES)
+			for (i=0; i<stats->tiles_x*stats->tiles_y; i++)
+				stats->tiles[i] += b->tiles[i];
 	}
-	return 0;
-} /* fastdebayer */
+	stats_finish(stats);
+}
 
 /* fastdebayerRGB
  * Very simple debayering. Makes one colour pixel out of 4 bayered pixels
  * This means that the resulting image is only width/2 by height/2 pixels
  * Image size is reduced by a factor of 4!
- * This needs about 6ms for a full 750x480 frame on leanXcam
  * And returns the image in RGB24 Format
  */
 int fastdebayerRGB(const struct OSC_PICTURE pRaw, 
 		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
 {
-	uint16 x,y;
-	uint32 outPos=0;
-	unsigned char *in  = (unsigned char *)pRaw.data;
-	unsigned char *out = (unsigned char *)pOut->data;
-	uint32 mean=0;
-	uint32 rowmean;
-	uint16 R1, G1, B1;
-
-	for (y=0; y<pRaw.height; y+=2) {
-		rowmean=0;
-		for (x=0; x<pRaw.width; x+=2) {
-			R1 = (unsigned char)in[(y+1)*pRaw.width+x+1];
-			G1 = (unsigned char)in[y*pRaw.width+x+1];
-			B1 = (unsigned char)in[y*pRaw.width+x];
-			/* Red */
-			out[outPos++]=R1;
-			/* Green */
-			out[outPos++]=G1;
-			/* Blue */
-			out[outPos++]=B1;
-			rowmean = rowmean + R1 +G1 +B1;
-		} /* for x */
-		mean = mean + (rowmean / (pRaw.width/2) / 3);
-	} /* for y */
-	pOut->width  = pRaw.width/2;
-	pOut->height = pRaw.height/2; 
-	pOut->type  = OSC_PICTURE_RGB_24;
-	if (stats != 0) {
-		stats->mean = mean / (pRaw.height / 2);
-	}
-	return 0;
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_RGB);
 } /* fastdebayer */
 
 /* fastdebayerYUV444
@@ -120,42 +858,7 @@ int fastdebayerRGB(const struct OSC_PICTURE pRaw,
 int fastdebayerYUV444(const struct OSC_PICTURE pRaw, 
 		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
 {
-	uint16 x,y;
-	uint32 outPos=0;
-	int16 pY1, pU1, pV1;
-	int16 R1, G1, B1;
-	unsigned char *in  = (unsigned char *)pRaw.data;
-	unsigned char *out = (unsigned char *)pOut->data;
-	uint32 rowmean;
-	uint32 mean=0;
-
-	for (y=0; y<pRaw.height; y+=2) {
-		rowmean=0;
-		for (x=0; x<pRaw.width; x+=2) {
-			R1 = in[(y+1)*pRaw.width+x+1];
-			G1 = in[y*pRaw.width+x+1];
-			B1 = in[y*pRaw.width+x];
-			/* Fixed-Point: Faktoren * 128 */
-			/* Y = 0.299*R+0.587*G+0.114*B) */
-
-			pY1 = ((38*R1 + 75*G1 + 15*B1) >> 7);	
-			pU1 = (((B1 - pY1)*63)>>7)+128;
-			pV1 = (((R1 - pY1)*112)>>7)+128;
-
-			rowmean = rowmean + pY1;
-
-			out[outPos++]=pY1;
-			out[outPos++]=pU1;
-			out[outPos++]=pV1;
-		} /* for x */
-		mean = mean + rowmean / (pRaw.width / 2);
-	} /* for y */
-	pOut->width  = pRaw.width/2;
-	pOut->height = pRaw.height/2; 
-	pOut->type  = OSC_PICTURE_YUV_444;
-	if (stats != 0)
-		stats->mean = mean / pOut->height;
-	return 0;
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_YUV444);
 } /* fastdebayer */
 
 
@@ -170,48 +873,7 @@ int fastdebayerYUV444(const struct OSC_PICTURE pRaw,
 int fastdebayerYUV422(const struct OSC_PICTURE pRaw, 
 		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
 {
-	uint16 x,y;
-	uint32 outPos=0;
-	int16 pY1, pY2, pU1, pV1;
-	int16 R1, G1, B1, R2, G2, B2;
-	unsigned char *in  = (unsigned char *)pRaw.data;
-	unsigned char *out = (unsigned char *)pOut->data;
-	uint32 rowmean;
-	uint32 mean=0;
-
-	for (y=0; y<pRaw.height; y+=2) {
-		rowmean=0;
-		for (x=0; x<pRaw.width; x+=4) {
-			R1 = in[(y+1)*pRaw.width+x+1];
-			G1 = in[y*pRaw.width+x+1];
-			B1 = in[y*pRaw.width+x];
-			R2 = in[(y+1)*pRaw.width+x+3];
-			G2 = in[y*pRaw.width+x+3];
-			B2 = in[y*pRaw.width+x+2];
-			/* Fixed-Point: Faktoren * 128 */
-			/* Y = 0.299*R+0.587*G+0.114*B) */
-
-			pY1 = ((38*R1 + 75*G1 + 15*B1) >> 7);	
-			pU1 = (((B1 - pY1)*63)>>7)+128;
-			pV1 = (((R1 - pY1)*112)>>7)+128;
-
-			pY2 =  (38*R2 + 75*G2 + 15*B2) >> 7;	
-
-			rowmean = rowmean + pY1 + pY2;
-
-			out[outPos++]=pU1;
-			out[outPos++]=pY1;
-			out[outPos++]=pV1;
-			out[outPos++]=pY2;
-		} /* for x */
-		mean = mean + rowmean / (pRaw.width / 2);
-	} /* for y */
-	pOut->width  = pRaw.width/2;
-	pOut->height = pRaw.height/2; 
-	pOut->type  = OSC_PICTURE_YUV_422;
-	if (stats != 0)
-		stats->mean = mean / pOut->height;
-	return 0;
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_YUV422);
 } /* fastdebayer */
 
 /* fastdebayerChromU
@@ -223,39 +885,7 @@ int fastdebayerYUV422(const struct OSC_PICTURE pRaw,
 int fastdebayerChromU(const struct OSC_PICTURE pRaw, 
 		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
 {
-	uint16 x,y;
-	uint32 outPos=0;
-	int16 pY1, pU1;
-	int16 R1, G1, B1;
-	unsigned char *in  = (unsigned char *)pRaw.data;
-	unsigned char *out = (unsigned char *)pOut->data;
-	uint32 rowmean;
-	uint32 mean=0;
-
-	for (y=0; y<pRaw.height; y+=2) {
-		rowmean=0;
-		for (x=0; x<pRaw.width; x+=2) {
-			R1 = in[(y+1)*pRaw.width+x+1];
-			G1 = in[y*pRaw.width+x+1];
-			B1 = in[y*pRaw.width+x];
-			/* Fixed-Point: Faktoren * 128 */
-			/* Y = 0.299*R+0.587*G+0.114*B) */
-
-			pY1 = ((38*R1 + 75*G1 + 15*B1) >> 7);	
-			pU1 = (((B1 - pY1)*63)>>7)+128;
-
-			rowmean = rowmean + pY1;
-
-			out[outPos++]=pU1;
-		} /* for x */
-		mean = mean + rowmean / (pRaw.width / 2);
-	} /* for y */
-	pOut->width  = pRaw.width/2;
-	pOut->height = pRaw.height/2; 
-	pOut->type  = OSC_PICTURE_CHROM_U;
-	if (stats != 0)
-		stats->mean = mean / pOut->height;
-	return 0;
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_CHROMU);
 } /* fastdebayer */
 
 /* fastdebayerChromV
@@ -267,83 +897,627 @@ int fastdebayerChromU(const struct OSC_PICTURE pRaw,
 int fastdebayerChromV(const struct OSC_PICTURE pRaw, 
 		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
 {
-	uint16 x,y;
-	uint32 outPos=0;
-	int16 pY1, pV1;
-	int16 R1, G1, B1;
-	unsigned char *in  = (unsigned char *)pRaw.data;
-	unsigned char *out = (unsigned char *)pOut->data;
-	uint32 rowmean;
-	uint32 mean=0;
-
-	for (y=0; y<pRaw.height; y+=2) {
-		rowmean=0;
-		for (x=0; x<pRaw.width; x+=2) {
-			R1 = in[(y+1)*pRaw.width+x+1];
-			G1 = in[y*pRaw.width+x+1];
-			B1 = in[y*pRaw.width+x];
-			/* Fixed-Point: Faktoren * 128 */
-			/* Y = 0.299*R+0.587*G+0.114*B) */
-
-			pY1 = ((38*R1 + 75*G1 + 15*B1) >> 7);	
-			pV1 = (((R1 - pY1)*112)>>7)+128;
-
-			rowmean = rowmean + pY1;
-
-			out[outPos++]=pV1;
-		} /* for x */
-		mean = mean + rowmean / (pRaw.width / 2);
-	} /* for y */
-	pOut->width  = pRaw.width/2;
-	pOut->height = pRaw.height/2; 
-	pOut->type  = OSC_PICTURE_CHROM_U;
-	if (stats != 0)
-		stats->mean = mean / pOut->height;
-	return 0;
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_CHROMV);
 } /* fastdebayer */
 
 /* fastgrey
  * Very simple debayering. Makes one grey pixel out of 4 bayered pixels
  * This means that the resulting image is only width/2 by height/2 pixels
  * Image size is reduced by a factor of 4!
- * This needs about 6ms for a full 750x480 frame on leanXcam and returns
- * the image in 8Bit per pixel greyscale format
- * The resulting image is also the Luminance part of a YUV image
+ * Returns the image in 8Bit per pixel greyscale format
+ * The resulting image is also the Luminance part of a YUV image, in the 
+ * matrix and range of yuv_tables_init()
  */
 int fastgrey(   const struct OSC_PICTURE pRaw, 
 		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
 {
-	uint16 x,y;
-	uint32 outPos=0;
-	int16 pY1;
-	int16 R1, G1, B1;
-	uint32 rowmean;
-	uint32 mean=0;
-
-	unsigned char *in  = (unsigned char *)pRaw.data;
-	unsigned char *out = (unsigned char *)pOut->data;
-
-	for (y=0; y<pRaw.height; y+=2) {
-		rowmean=0;
-		for (x=0; x<pRaw.width; x+=2) {
-			R1 = in[(y+1)*pRaw.width+x+1];
-			G1 = in[y*pRaw.width+x+1];
-			B1 = in[y*pRaw.width+x];
-			/* Fixed-Point: Faktoren * 128 */
-			/* Y = 0.299*R+0.587*G+0.114*B) */
-
-			pY1 = ((38*R1 + 75*G1 + 15*B1) >> 7);	
-
-			rowmean = rowmean + pY1;
-
-			out[outPos++]=pY1;
-		} /* for x */
-		mean = mean + rowmean / (pRaw.width / 2);
-	} /* for y */
-	pOut->width  = pRaw.width/2;
-	pOut->height = pRaw.height/2; 
-	pOut->type  = OSC_PICTURE_GREYSCALE;
-	if (stats != 0)
-		stats->mean = mean / pOut->height;
-	return 0;
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_GREY);
 } /* fastdebayer */
+
+/* fastdebayerI420
+ * Very simple debayering. Makes one pixel out of 4 bayered pixels
+ * and returns it as planar YUV 4:2:0 (I420, YU12): the Y plane of 
+ * width/2 by height/2 pixels followed by the U and V planes of the 2x2 
+ * means, half as wide and high. pOut describes the Y plane as a greyscale
+ * picture, the whole frame is YUV420_SIZE() bytes, half of BGR24. 
+ * Y, U and V in the matrix and range of yuv_tables_init()
+ */
+int fastdebayerI420(const struct OSC_PICTURE pRaw, 
+		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
+{
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_I420);
+} /* fastdebayerI420 */
+
+/* fastdebayerNV12
+ * Same as fastdebayerI420() but the Y plane is followed by one plane of
+ * interleaved U and V (NV12)
+ */
+int fastdebayerNV12(const struct OSC_PICTURE pRaw, 
+		struct OSC_PICTURE *pOut, struct ImgStats *stats) 
+{
+	return debayer(&pRaw, 0, pOut, 0, 0, stats, ROW_BGBG, FALSE, FMT_NV12);
+} /* fastdebayerNV12 */
+
+/* fastbinLuma
+ * Only the grey picture of fastbinBGRGrey(), for the motion detection of
+ * the frames which need no colour picture: the same luminance, binning, 
+ * Bayer order and window, and the rows are fed into ii if it is not NULL.
+ * Saves the colour rows of the fused pass and their stores.
+ */
+int fastbinLuma(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pGrey, struct integral *ii, 
+		enum EnBayerOrder order, struct ImgStats *stats) 
+{
+	return debayer(&pRaw, view, pGrey, 0, ii, stats, order, TRUE, 
+		       FMT_LUMA);
+} /* fastbinLuma */
+
+/* fastbinGrey
+ * fastgrey() with the binning, Bayer order and window of fastbinBGR(), 
+ * the rows are fed into ii if it is not NULL: the Y plane of fastbinI420()
+ * alone.
+ */
+int fastbinGrey(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pOut, struct integral *ii, 
+		enum EnBayerOrder order, struct ImgStats *stats) 
+{
+	return debayer(&pRaw, view, pOut, 0, ii, stats, order, TRUE, 
+		       FMT_GREY);
+} /* fastbinGrey */
+
+/* fastbinI420
+ * fastdebayerI420() with the binning, Bayer order and window of 
+ * fastbinBGR(). If ii is not NULL, the Y rows are fed into it like the 
+ * grey rows of fastbinBGRGrey(), the Y plane can then go to 
+ * is_alarm_integral().
+ */
+int fastbinI420(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pOut, struct integral *ii, 
+		enum EnBayerOrder order, struct ImgStats *stats) 
+{
+	return debayer(&pRaw, view, pOut, 0, ii, stats, order, TRUE, 
+		       FMT_I420);
+} /* fastbinI420 */
+
+/************************************************************************
+ * Full resolution demosaic						*
+ ************************************************************************/
+
+/* Clamps a filter result to a colour value */
+static ALWAYS_INLINE uint8 clamp255(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* demosaic_colour
+ * Interpolates a B or R site of the padded rows r[0..4] (r[2] is the 
+ * current row): green g from the cross and the other colour d from the 
+ * diagonals. Malvar-He-Cutler corrects both with the Laplacian of the 
+ * site's own colour, the weights are the ones of the paper times 16.
+ */
+static ALWAYS_INLINE void demosaic_colour(const uint8 *const r[5], int x, 
+					  int *g, int *d, 
+					  const enum demosaic_mode mode)
+{
+	const int c = r[2][x];
+	const int cross = r[1][x] + r[3][x] + r[2][x-1] + r[2][x+1];
+	const int diag = r[1][x-1] + r[1][x+1] + r[3][x-1] + r[3][x+1];
+	int far;
+
+	if (mode == DEMOSAIC_BILINEAR) {
+		*g = (cross + 2) >> 2;
+		*d = (diag + 2) >> 2;
+		return;
+	}
+	far = r[0][x] + r[4][x] + r[2][x-2] + r[2][x+2];
+	*g = clamp255((8*c + 4*cross - 2*far + 8) >> 4);
+	*d = clamp255((12*c + 4*diag - 3*far + 8) >> 4);
+}
+
+/* demosaic_green
+ * Interpolates a G site: h is the colour of the left and right 
+ * neighbours, v the colour of the upper and lower neighbours.
+ */
+static ALWAYS_INLINE void demosaic_green(const uint8 *const r[5], int x, 
+					 int *h, int *v, 
+					 const enum demosaic_mode mode)
+{
+	const int c = r[2][x];
+	const int hor = r[2][x-1] + r[2][x+1];
+	const int ver = r[1][x] + r[3][x];
+	int diag, hfar, vfar;
+
+	if (mode == DEMOSAIC_BILINEAR) {
+		*h = (hor + 1) >> 1;
+		*v = (ver + 1) >> 1;
+		return;
+	}
+	diag = r[1][x-1] + r[1][x+1] + r[3][x-1] + r[3][x+1];
+	hfar = r[2][x-2] + r[2][x+2];
+	vfar = r[0][x] + r[4][x];
+	*h = clamp255((10*c + 8*hor - 2*hfar - 2*diag + vfar + 8) >> 4);
+	*v = clamp255((10*c + 8*ver - 2*vfar - 2*diag + hfar + 8) >> 4);
+}
+
+/* Copies row y of the window v (mirrored at the top and bottom) into a 
+ * padded row and mirrors 2 pixels at both ends, the Bayer phase is kept. */
+static void demosaic_pad(const struct OSC_PICTURE *pRaw, 
+			 const struct pic_view *v, int y, uint8 *pad)
+{
+	const int w = v->w;
+	const int h = v->h;
+
+	if (y < 0)
+		y = -y;
+	else if (y >= h)
+		y = 2*h - 2 - y;
+	memcpy(pad, pic_view_row(pRaw, v, y), w);
+	pad[-1] = pad[1];
+	pad[-2] = pad[2];
+	pad[w]   = pad[w-2];
+	pad[w+1] = pad[w-3];
+}
+
+static ALWAYS_INLINE int demosaic(const struct OSC_PICTURE *pRaw, 
+				  const struct pic_view *view,
+				  struct OSC_PICTURE *pOut, 
+				  enum EnBayerOrder order,
+				  const enum demosaic_mode mode)
+{
+	uint8 pad[5][OSC_CAM_MAX_IMAGE_WIDTH + 4];
+	const uint8 *r[5];
+	const uint8 *tmp;
+	struct pic_view v;
+	int w, bodd, bc;
+	uint8 *out = (uint8 *)pOut->data;
+	uint8 *o;
+	int x, y, i, a, b;
+
+	pic_view_clip(&v, pRaw, view);
+	w = v.w;
+	if (w > OSC_CAM_MAX_IMAGE_WIDTH || w < 4 || v.h < 4 || (w | v.h) & 1)
+		return -1;
+	/* Row parity of blue and column of blue in its row, red is in the
+	 * other row and column */
+	order = bayer_order_at(order, v.x, v.y);
+	bodd = (order == ROW_RGRG || order == ROW_GRGR);
+	bc = (order == ROW_GBGB || order == ROW_RGRG);
+
+	for (i=0; i<5; i++) {
+		demosaic_pad(pRaw, &v, i-2, pad[i] + 2);
+		r[i] = pad[i] + 2;
+	}
+
+	for (y=0; y<v.h; y++) {
+		if (y > 0) {
+			/* Slide the window down by one row */
+			tmp = r[0];
+			for (i=0; i<4; i++)
+				r[i] = r[i+1];
+			r[4] = tmp;
+			demosaic_pad(pRaw, &v, y+2, (uint8 *)tmp);
+		}
+		if ((y & 1) == bodd) {
+			/* B G B G or G B G B */
+			for (x=0; x<w; x+=2) {
+				demosaic_colour(r, x+bc, &a, &b, mode);
+				o = out + 3*(x+bc);
+				o[0] = r[2][x+bc];
+				o[1] = a;
+				o[2] = b;
+				demosaic_green(r, x+1-bc, &a, &b, mode);
+				o = out + 3*(x+1-bc);
+				o[0] = a;
+				o[1] = r[2][x+1-bc];
+				o[2] = b;
+			}
+		} else {
+			/* G R G R or R G R G */
+			for (x=0; x<w; x+=2) {
+				demosaic_green(r, x+bc, &a, &b, mode);
+				o = out + 3*(x+bc);
+				o[0] = b;
+				o[1] = r[2][x+bc];
+				o[2] = a;
+				demosaic_colour(r, x+1-bc, &a, &b, mode);
+				o = out + 3*(x+1-bc);
+				o[0] = b;
+				o[1] = a;
+				o[2] = r[2][x+1-bc];
+			}
+		}
+		out += 3*w;
+	}
+	pOut->width  = w;
+	pOut->height = v.h; 
+	pOut->type  = OSC_PICTURE_BGR_24;
+	return 0;
+}
+
+/* demosaicBGR
+ * Full resolution debayering, the picture keeps the size of the raw frame
+ * and is returned in BGR24 Format. DEMOSAIC_BILINEAR averages the nearest
+ * samples of every missing colour, DEMOSAIC_MHC is the gradient corrected
+ * interpolation of Malvar, He and Cutler in integer arithmetic: sharper 
+ * edges and less colour fringing for about four times the work. Both are 
+ * meant for single snapshots, not for every frame.
+ * order is the Bayer order of the first row, see OscCamGetBayerOrder().
+ * Only the window view is demosaiced if view is not NULL, the picture then
+ * has the size of the window. The raw frame or window is mirrored at the 
+ * borders. Returns -1 if it is wider than the camera or has an odd size.
+ */
+int demosaicBGR(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pOut, enum EnBayerOrder order, 
+		enum demosaic_mode mode)
+{
+	if (mode == DEMOSAIC_MHC)
+		return demosaic(&pRaw, view, pOut, order, DEMOSAIC_MHC);
+	return demosaic(&pRaw, view, pOut, order, DEMOSAIC_BILINEAR);
+}
+
+/************************************************************************
+ * Conversion of the stream pictures					*
+ ************************************************************************/
+
+/* bgr_scale_row
+ * Averages scale x scale pixels of the BGR24 rows from row y on into w 
+ * pixels of b, g and r.
+ */
+static void bgr_scale_row(const struct OSC_PICTURE *in, int y, int scale, 
+			  int w, uint8 *b, uint8 *g, uint8 *r)
+{
+	const uint8 *row = (const uint8 *)in->data + 3*in->width*y*scale;
+	const int n = scale*scale;
+	int x, i, j;
+	uint32 sb, sg, sr;
+	const uint8 *p;
+
+	if (scale == 1) {
+		for (x=0; x<w; x++) {
+			b[x] = row[3*x];
+			g[x] = row[3*x+1];
+			r[x] = row[3*x+2];
+		}
+		return;
+	}
+	for (x=0; x<w; x++) {
+		sb = sg = sr = n/2;
+		for (j=0; j<scale; j++) {
+			p = row + 3*(in->width*j + x*scale);
+			for (i=0; i<scale; i++, p+=3) {
+				sb += p[0];
+				sg += p[1];
+				sr += p[2];
+			}
+		}
+		b[x] = sb/n;
+		g[x] = sg/n;
+		r[x] = sr/n;
+	}
+}
+
+/* bgr_convert
+ * Converts a BGR24 picture, e.g. of fastbinBGR(), into fmt and decimates 
+ * it by scale (1, 2 or 4) by averaging scale x scale pixels. Y, U and V 
+ * in the matrix and range of yuv_tables_init() and with the chroma 
+ * sampling of the debayering: YUV 4:2:2 takes it from the first pixel of
+ * each pair, I420 from the 2x2 means. The YUV formats have an even width
+ * and I420 an even height, an odd last pixel or row is cut off. 
+ * Returns the size of the output in bytes or -1 for an unsupported 
+ * picture, format or scale.
+ */
+int bgr_convert(const struct OSC_PICTURE *in, struct OSC_PICTURE *out,
+		enum pic_format fmt, int scale)
+{
+	static uint8 b[2][OSC_CAM_MAX_IMAGE_WIDTH];
+	static uint8 g[2][OSC_CAM_MAX_IMAGE_WIDTH];
+	static uint8 r[2][OSC_CAM_MAX_IMAGE_WIDTH];
+	uint8 *o = out->data;
+	uint8 *u, *v;
+	int w, h, x, y, k, n;
+	int R, G, B;
+
+	if (in->type != OSC_PICTURE_BGR_24 || in->width > OSC_CAM_MAX_IMAGE_WIDTH
+	    || (scale != 1 && scale != 2 && scale != 4))
+		return -1;
+	w = in->width/scale;
+	h = in->height/scale;
+	if (fmt == PIC_YUV422 || fmt == PIC_I420)
+		w &= ~1;
+	if (fmt == PIC_I420)
+		h &= ~1;
+	if (fmt != PIC_BGR24 && !Yuv.ready)
+		yuv_tables_init(YUV_BT601, YUV_FULL_RANGE);
+
+	out->width = w;
+	out->height = h;
+	switch (fmt) {
+	case PIC_BGR24:
+		out->type = OSC_PICTURE_BGR_24;
+		for (y=0; y<h; y++) {
+			bgr_scale_row(in, y, scale, w, b[0], g[0], r[0]);
+			for (x=0; x<w; x++, o+=3) {
+				o[0] = b[0][x];
+				o[1] = g[0][x];
+				o[2] = r[0][x];
+			}
+		}
+		return 3*w*h;
+	case PIC_GREY:
+		out->type = OSC_PICTURE_GREYSCALE;
+		for (y=0; y<h; y++) {
+			bgr_scale_row(in, y, scale, w, b[0], g[0], r[0]);
+			for (x=0; x<w; x++)
+				*o++ = YUV_Y(r[0][x], g[0][x], b[0][x]);
+		}
+		return w*h;
+	case PIC_YUV422:
+		out->type = OSC_PICTURE_YUV_422;
+		for (y=0; y<h; y++) {
+			bgr_scale_row(in, y, scale, w, b[0], g[0], r[0]);
+			for (x=0; x<w; x+=2, o+=4) {
+				o[0] = YUV_U(r[0][x], g[0][x], b[0][x]);
+				o[1] = YUV_Y(r[0][x], g[0][x], b[0][x]);
+				o[2] = YUV_V(r[0][x], g[0][x], b[0][x]);
+				o[3] = YUV_Y(r[0][x+1], g[0][x+1], b[0][x+1]);
+			}
+		}
+		return 2*w*h;
+	case PIC_I420:
+		/* Same layout as fastdebayerI420() */
+		out->type = OSC_PICTURE_GREYSCALE;
+		u = o + w*h;
+		v = u + w/2*h/2;
+		for (y=0; y<h; y+=2) {
+			for (k=0; k<2; k++) {
+				bgr_scale_row(in, y+k, scale, w, b[k], g[k], r[k]);
+				for (x=0; x<w; x++)
+					*o++ = YUV_Y(r[k][x], g[k][x], b[k][x]);
+			}
+			for (x=0; x<w; x+=2) {
+				n = x+1;
+				B = (b[0][x] + b[0][n] + b[1][x] + b[1][n] + 2) >> 2;
+				G = (g[0][x] + g[0][n] + g[1][x] + g[1][n] + 2) >> 2;
+				R = (r[0][x] + r[0][n] + r[1][x] + r[1][n] + 2) >> 2;
+				*u++ = YUV_U(R, G, B);
+				*v++ = YUV_V(R, G, B);
+			}
+		}
+		return YUV420_SIZE(w, h);
+	}
+	return -1;
+} /* bgr_convert */
+
+#if defined(OSC_HOST)
+static int bench_binBGR(const struct OSC_PICTURE pRaw, 
+			struct OSC_PICTURE *pOut, struct ImgStats *stats)
+{
+	return fastbinBGR(pRaw, 0, pOut, ROW_BGBG, stats);
+}
+
+/* The fused pass in bands on the thread pool */
+struct bench_job {
+	struct OSC_PICTURE raw, *out, *grey;
+	struct ImgStats stats[POOL_MAX_BANDS];
+};
+
+static void bench_band(void *arg, int band, int bands)
+{
+	struct bench_job *job = arg;
+
+	fastbinBGRGreyBand(job->raw, 0, job->out, job->grey, ROW_BGBG, 
+			   &job->stats[band], band, bands);
+}
+
+static double elapsed_ns(const struct timespec *t0, 
+			 const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec)*1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/* yuv_check
+ * Compares fastdebayerYUV444() on the raw frame with the floating point
+ * transform of the pixels of fastdebayerRGB() for every matrix and range,
+ * prints the largest error and the share of exact values.
+ * Returns the largest error of all matrices and ranges.
+ */
+static int yuv_check(const struct OSC_PICTURE raw)
+{
+	static const char *ranges[] = { "full", "limited" };
+	struct OSC_PICTURE rgb, yuv;
+	const uint8 *p, *q;
+	int m, r, i, c, err, maxerr, worst = 0;
+	uint32 exact;
+	double kr, kb, y, ref[3];
+
+	rgb.data = malloc(3*raw.width/2*raw.height/2);
+	yuv.data = malloc(3*raw.width/2*raw.height/2);
+	if (rgb.data == 0 || yuv.data == 0)
+		fatalerror("Did not get memory\n");
+	fastdebayerRGB(raw, &rgb, 0);
+
+	for (m=YUV_BT601; m<=YUV_BT709; m++) {
+		for (r=YUV_FULL_RANGE; r<=YUV_LIMITED_RANGE; r++) {
+			yuv_tables_init(m, r);
+			fastdebayerYUV444(raw, &yuv, 0);
+			kr = m == YUV_BT709 ? 0.2126 : 0.299;
+			kb = m == YUV_BT709 ? 0.0722 : 0.114;
+			maxerr = 0;
+			exact = 0;
+			p = rgb.data;
+			q = yuv.data;
+			for (i=0; i<yuv.width*yuv.height; i++, p+=3, q+=3) {
+				y = kr*p[0] + (1.0 - kr - kb)*p[1] + kb*p[2];
+				ref[0] = y;
+				ref[1] = (p[2] - y)/(2.0*(1.0 - kb));
+				ref[2] = (p[0] - y)/(2.0*(1.0 - kr));
+				for (c=0; c<3; c++) {
+					if (r == YUV_LIMITED_RANGE)
+						ref[c] *= (c == 0 ? 219.0 : 224.0)/255.0;
+					ref[c] += c == 0 ? 
+						(r == YUV_LIMITED_RANGE ? 16 : 0) : 128;
+					ref[c] = ref[c] > 255.0 ? 255.0 : ref[c];
+					err = abs(q[c] - (int)(ref[c] + 0.5));
+					maxerr = max(maxerr, err);
+					if (err == 0)
+						exact++;
+				}
+			}
+			printf("YUV BT.%s %-7s max error %d, %.3f%% exact\n",
+			       m == YUV_BT709 ? "709" : "601", ranges[r], maxerr,
+			       100.0*exact/(3*yuv.width*yuv.height));
+			worst = max(worst, maxerr);
+		}
+	}
+	yuv_tables_init(YUV_BT601, YUV_FULL_RANGE);
+	free(rgb.data);
+	free(yuv.data);
+	return worst;
+}
+
+/* debayer_bench
+ * Host only: times every output format and the full resolution demosaic
+ * modes on a synthetic 752x480 raw frame and prints the result in 
+ * ns/frame, after the accuracy of the YUV tables. Run with 
+ * "leanXalarm_host bench".
+ * Returns the largest error of the YUV tables, see yuv_check().
+ */
+int debayer_bench(void)
+{
+	static const struct {
+		const char *name;
+		int (*fn)(const struct OSC_PICTURE, struct OSC_PICTURE *, 
+			  struct ImgStats *);
+	} formats[] = {
+		{ "BGR",     fastdebayerBGR },
+		{ "RGB",     fastdebayerRGB },
+		{ "YUV422",  fastdebayerYUV422 },
+		{ "YUV444",  fastdebayerYUV444 },
+		{ "ChromU",  fastdebayerChromU },
+		{ "ChromV",  fastdebayerChromV },
+		{ "grey",    fastgrey },
+		{ "I420",    fastdebayerI420 },
+		{ "NV12",    fastdebayerNV12 },
+		{ "binBGR",  bench_binBGR },
+	};
+	const int width = 752, height = 480, rounds = 200;
+	struct OSC_PICTURE raw, out, grey;
+	struct ImgStats stats;
+	struct pic_view window;
+	struct bench_job *job;
+	int threads;
+	struct timespec t0, t1;
+	uint32 seed = 12345;
+	int i, r, yuverr;
+	double ns;
+
+	raw.data = malloc(width*height);
+	out.data = malloc(3*width/2*height/2);
+	grey.data = malloc(width/2*height/2);
+	if (raw.data == 0 || out.data == 0 || grey.data == 0)
+		fatalerror("Did not get memory\n");
+	raw.width = width;
+	raw.height = height;
+	raw.type = OSC_PICTURE_GREYSCALE;
+	stats.want = STATS_MEAN;
+	for (i=0; i<width*height; i++) {
+		seed = seed*1103515245 + 12345;
+		((uint8 *)raw.data)[i] = seed >> 24;
+	}
+	yuverr = yuv_check(raw);
+
+	for (i=0; i<=sizeof(formats)/sizeof(formats[0]); i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (r=0; r<rounds; r++) {
+			if (i < sizeof(formats)/sizeof(formats[0]))
+				formats[i].fn(raw, &out, &stats);
+			else
+				fastdebayerBGRGrey(raw, &out, &grey, 0, &stats);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = elapsed_ns(&t0, &t1) / rounds;
+		printf("%-10s %10.0f ns/frame\n", 
+		       i < sizeof(formats)/sizeof(formats[0]) ? 
+		       formats[i].name : "BGRGrey", ns);
+	}
+
+	/* The fused pass as used by main, without and with all statistics */
+	for (i=0; i<2; i++) {
+		stats.want = i == 0 ? STATS_MEAN : STATS_MEAN | STATS_CHANNELS |
+			STATS_MINMAX | STATS_HIST | STATS_TILES;
+		stats.tiles_x = stats.tiles_y = 8;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (r=0; r<rounds; r++)
+			fastbinBGRGrey(raw, 0, &out, &grey, 0, ROW_BGBG, 
+				       &stats);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("%-10s %10.0f ns/frame\n", i == 0 ? "binGrey" : 
+		       "binGrey+st", elapsed_ns(&t0, &t1) / rounds);
+	}
+
+	/* The fused pass on a centred window of a quarter of the frame, read
+	 * in place */
+	window.x = width/4;
+	window.y = height/4;
+	window.w = width/2;
+	window.h = height/2;
+	window.stride = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r=0; r<rounds; r++)
+		fastbinBGRGrey(raw, &window, &out, &grey, 0, ROW_BGBG, &stats);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%-10s %10.0f ns/frame (%dx%d window)\n", "window+st", 
+	       elapsed_ns(&t0, &t1) / rounds, window.w, window.h);
+
+	/* The same with all statistics in 16 bands on one thread per CPU */
+	job = malloc(sizeof(*job));
+	if (job == 0)
+		fatalerror("Did not get memory\n");
+	job->raw = raw;
+	job->out = &out;
+	job->grey = &grey;
+	for (i=0; i<16; i++)
+		job->stats[i] = stats;
+	threads = pool_start(0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r=0; r<rounds; r++) {
+		pool_run(bench_band, job, 16);
+		stats_merge(&stats, job->stats, 16);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pool_stop();
+	printf("%-10s %10.0f ns/frame (%d threads)\n", "bands+st", 
+	       elapsed_ns(&t0, &t1) / rounds, threads);
+	free(job);
+
+	/* The motion detection alone, as main runs it while nobody needs the
+	 * colour picture, with the statistics of main */
+	stats.want = STATS_MEAN | STATS_CHANNELS | STATS_MINMAX;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r=0; r<rounds; r++)
+		fastbinLuma(raw, 0, &grey, 0, ROW_BGBG, &stats);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%-10s %10.0f ns/frame\n", "binLuma+st", 
+	       elapsed_ns(&t0, &t1) / rounds);
+
+	/* The full resolution modes against the 2x2 path */
+	free(out.data);
+	out.data = malloc(3*width*height);
+	if (out.data == 0)
+		fatalerror("Did not get memory\n");
+	for (i=DEMOSAIC_BILINEAR; i<=DEMOSAIC_MHC; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (r=0; r<rounds; r++)
+			demosaicBGR(raw, 0, &out, ROW_BGBG, i);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = elapsed_ns(&t0, &t1) / rounds;
+		printf("%-10s %10.0f ns/frame (full resolution)\n", 
+		       i == DEMOSAIC_MHC ? "MHC" : "bilinear", ns);
+	}
+
+	free(raw.data);
+	free(out.data);
+	free(grey.data);
+	return yuverr;
+}
+#endif /* OSC_HOST */
@@ -22,13 +22,79 @@
 #ifndef H_LEANXALGOS
 #define H_LEANXALGOS
 
+/* Statistics a debayer pass can gather in the same loop, the STATS_* 
+ * flags in want select them. The mean is always there. */
+#define STATS_MEAN	0x01
+#define STATS_CHANNELS	0x02	/* mean_r, mean_g, mean_b, mean_y */
+#define STATS_MINMAX	0x04	/* min_y, max_y */
+#define STATS_HIST	0x08	/* hist */
+#define STATS_TILES	0x10	/* tiles */
+
+#define STATS_MAX_TILES_X 16
+#define STATS_MAX_TILES_Y 16
+
 struct ImgStats {
+	/* Set by the caller */
+	int want;		/* STATS_* flags */
+	int tiles_x, tiles_y;	/* Grid of STATS_TILES */
+
+	/* Mean of (R+G+B)/3 for the RGB formats, else of the luminance */
 	unsigned char mean;
-} ImgStats;
+	/* The sums behind the means, sum/count is the mean */
+	uint32 sum, count, pixels;
+	uint32 sum_r, sum_g, sum_b, sum_y;
+	uint8 mean_r, mean_g, mean_b, mean_y;
+	uint8 min_y, max_y;
+	uint32 hist[256];	/* Luminance histogram */
+	/* Luminance sums of the tiles, row by row */
+	uint32 tiles[STATS_MAX_TILES_X*STATS_MAX_TILES_Y];
+};
+
+struct integral;
+struct pic_view;
+
+/* Colour matrix and range of the YUV formats, see yuv_tables_init() */
+enum yuv_matrix {
+	YUV_BT601,
+	YUV_BT709
+};
+
+enum yuv_range {
+	YUV_FULL_RANGE,
+	YUV_LIMITED_RANGE
+};
+
+void yuv_tables_init(enum yuv_matrix matrix, enum yuv_range range);
 
 int fastdebayerBGR(const struct OSC_PICTURE pRaw, 
 		   struct OSC_PICTURE *pOut, struct ImgStats *stats); 
 
+int fastdebayerBGRGrey(const struct OSC_PICTURE pRaw, 
+		struct OSC_PICTURE *pOut, struct OSC_PICTURE *pGrey, 
+		struct integral *ii, struct ImgStats *stats); 
+
+int fastbinBGR(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+	       struct OSC_PICTURE *pOut, enum EnBayerOrder order, 
+	       struct ImgStats *stats); 
+
+int fastbinBGRGrey(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pOut, struct OSC_PICTURE *pGrey, 
+		struct integral *ii, enum EnBayerOrder order, 
+		struct ImgStats *stats); 
+
+int fastbinLuma(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pGrey, struct integral *ii, 
+		enum EnBayerOrder order, struct ImgStats *stats); 
+
+int fastbinBGRGreyBand(const struct OSC_PICTURE pRaw, 
+		const struct pic_view *view,
+		struct OSC_PICTURE *pOut, struct OSC_PICTURE *pGrey, 
+		enum EnBayerOrder order, struct ImgStats *stats, 
+		int band, int bands); 
+
+void stats_merge(struct ImgStats *stats, const struct ImgStats *bands, 
+		int n);
+
 int fastdebayerRGB(const struct OSC_PICTURE pRaw, 
 		   struct OSC_PICTURE *pOut, struct ImgStats *stats); 
 
@@ -47,4 +113,46 @@ int fastdebayerChromV(const struct OSC_PICTURE pRaw,
 int fastgrey(   const struct OSC_PICTURE pRaw, 
 		struct OSC_PICTURE *pOut, struct ImgStats *stats); 
 
+/* Bytes of a planar 4:2:0 frame whose Y plane is w x h pixels */
+#define YUV420_SIZE(w, h) ((w)*(h) + 2*((w)/2)*((h)/2))
+
+int fastdebayerI420(const struct OSC_PICTURE pRaw, 
+		struct OSC_PICTURE *pOut, struct ImgStats *stats); 
+
+int fastdebayerNV12(const struct OSC_PICTURE pRaw, 
+		struct OSC_PICTURE *pOut, struct ImgStats *stats); 
+
+int fastbinGrey(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pOut, struct integral *ii, 
+		enum EnBayerOrder order, struct ImgStats *stats); 
+
+int fastbinI420(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pOut, struct integral *ii, 
+		enum EnBayerOrder order, struct ImgStats *stats); 
+
+/* Interpolation of the full resolution demosaic */
+enum demosaic_mode {
+	DEMOSAIC_BILINEAR,
+	DEMOSAIC_MHC		/* gradient corrected, Malvar-He-Cutler */
+};
+
+int demosaicBGR(const struct OSC_PICTURE pRaw, const struct pic_view *view,
+		struct OSC_PICTURE *pOut, enum EnBayerOrder order, 
+		enum demosaic_mode mode);
+
+/* Formats of bgr_convert(), also the format codes of the stream */
+enum pic_format {
+	PIC_BGR24,
+	PIC_GREY,
+	PIC_YUV422,
+	PIC_I420	/* pOut is the Y plane, see fastdebayerI420() */
+};
+
+int bgr_convert(const struct OSC_PICTURE *in, struct OSC_PICTURE *out,
+		enum pic_format fmt, int scale);
+
+#if defined(OSC_HOST)
+int debayer_bench(void);
+#endif
+
 #endif
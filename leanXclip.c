@@ -0,0 +1,271 @@
+/*	leanXclip.c
+	Copyright (C) 2009 Reto Baettig
+	
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2.1 of the License, or (at
+	your option) any later version.
+	
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+	General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*!@file leanXclip.c
+ * @Pre-alarm frame ring and alarm clip capture
+ *
+ * The capture loop debayers every frame into a frame of the frame pool and
+ * commits it (clip_commit()); the clip keeps a reference to the last 
+ * frames, so they are always at hand without copying. It needs every 
+ * frame while it keeps a pre-roll or records (clip_wants_frames()). On a
+ * trigger the 
+ * pre-roll frames and the following post-trigger frames are referenced by
+ * the clip and then written as one raw video file by a background thread,
+ * which releases them again.
+ * The file contains the frames back to back (e.g. BGR24 376x240) and can be
+ * played with play.sh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "inc/oscar.h"
+#include "leanXtools.h"
+#include "leanXclip.h"
+
+enum clip_state {
+	CLIP_IDLE,
+	CLIP_RECORDING, /* collecting the post-trigger frames */
+	CLIP_WRITING
+};
+
+static struct framepool *pool;
+static int pre_frames, post_frames;
+static const char **history; /* referenced pre-roll, oldest at hist_pos */
+static int hist_len, hist_pos;
+static const char **clip_frames; /* referenced frames of the clip in order */
+static int clip_len;
+static int clip_target; /* clip_len when the clip is complete */
+static char clip_name[100];
+static int framesize;
+static enum clip_state state;
+static bool stop;
+static struct clip_stats stats;
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+
+/*
+ * release_clip
+ * Releases all frames of the clip, to be called with the lock held.
+ */
+static void release_clip(void)
+{
+	int i;
+
+	for (i=0; i<clip_len; i++)
+		fpool_unref(pool, clip_frames[i]);
+	clip_len = 0;
+	state = CLIP_IDLE;
+}
+
+static void *clip_worker(void *arg)
+{
+	char tmpname[110];
+	FILE *fp;
+	int i;
+	bool ok;
+
+	pthread_mutex_lock(&lock);
+	while (TRUE) {
+		while (state != CLIP_WRITING && !stop)
+			pthread_cond_wait(&wakeup, &lock);
+		if (state != CLIP_WRITING)
+			break;
+		/* The frames of the clip are not written to while referenced */
+		pthread_mutex_unlock(&lock);
+
+		ok = FALSE;
+		sprintf(tmpname, "%s.tmp", clip_name);
+		fp = fopen(tmpname, "wb");
+		if (fp != NULL) {
+			ok = TRUE;
+			for (i=0; i<clip_len && ok; i++) 
+				ok = fwrite(clip_frames[i], 1, framesize, fp) == 
+					framesize;
+			fclose(fp);
+			ok = ok && (rename(tmpname, clip_name) == 0);
+		}
+
+		pthread_mutex_lock(&lock);
+		if (ok)
+			stats.written++;
+		else
+			stats.failed++;
+		release_clip();
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * clip_init
+ *
+ * Prepares clips of pre frames before and post frames after the trigger,
+ * all frames are frames of the pool p, and starts the clip writer. The 
+ * clip keeps up to 2*pre+post frames of the pool referenced.
+ *
+ * Return value: 0 on success
+ */
+int clip_init(int pre, int post, struct framepool *p)
+{
+	pool = p;
+	pre_frames = pre;
+	post_frames = post;
+	history = malloc((pre + 1) * sizeof(*history));
+	clip_frames = malloc((pre + post + 1) * sizeof(*clip_frames));
+	if (history == NULL || clip_frames == NULL)
+		fatalerror("Did not get memory\n");
+	hist_len = hist_pos = 0;
+	clip_len = 0;
+	state = CLIP_IDLE;
+	stop = FALSE;
+
+	if (pthread_create(&worker, NULL, clip_worker, NULL) != 0) {
+		OscLog(ERROR, "Could not start the clip writer\n");
+		return -1;
+	}
+	return 0;
+} /* clip_init */
+
+/*
+ * clip_stop
+ *
+ * Stops the clip writer and releases all frames, a clip still recording
+ * is not written.
+ */
+void clip_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	stop = TRUE;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+	pthread_join(worker, NULL);
+
+	release_clip();
+	for (i=0; i<hist_len; i++)
+		fpool_unref(pool, history[(hist_pos + i) % pre_frames]);
+	hist_len = 0;
+	free(history);
+	free(clip_frames);
+} /* clip_stop */
+
+/*
+ * clip_commit
+ *
+ * The frame of size bytes, a frame of the pool, is complete. The clip 
+ * takes its own references, the caller keeps its reference.
+ */
+void clip_commit(const void *frame, int size)
+{
+	pthread_mutex_lock(&lock);
+	if (pre_frames > 0) {
+		fpool_ref(pool, frame);
+		if (hist_len == pre_frames) {
+			/* Replace the oldest frame of the pre-roll */
+			fpool_unref(pool, history[hist_pos]);
+			history[hist_pos] = frame;
+			hist_pos = (hist_pos + 1) % pre_frames;
+		} else {
+			history[(hist_pos + hist_len++) % pre_frames] = frame;
+		}
+	}
+	/* Not while the writer uses it, a clip without pre-roll gets it 
+	 * from its first frame */
+	if (state != CLIP_WRITING)
+		framesize = size;
+	if (state == CLIP_RECORDING) {
+		fpool_ref(pool, frame);
+		clip_frames[clip_len++] = frame;
+		if (clip_len == clip_target) {
+			state = CLIP_WRITING;
+			pthread_cond_signal(&wakeup);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+} /* clip_commit */
+
+/*
+ * clip_wants_frames
+ *
+ * Return value: true if the next frame has to be committed, for the 
+ * pre-roll or a clip which waits for more frames
+ */
+bool clip_wants_frames(void)
+{
+	bool ret;
+
+	pthread_mutex_lock(&lock);
+	ret = pre_frames > 0 || state == CLIP_RECORDING;
+	pthread_mutex_unlock(&lock);
+	return ret;
+} /* clip_wants_frames */
+
+/*
+ * clip_trigger
+ *
+ * Starts a clip with the last committed frames as pre-roll, the next
+ * post frames are added as they are committed. The clip is written to
+ * filename in the background.
+ *
+ * Return value: false, if the previous clip is still busy
+ */
+bool clip_trigger(const char *filename)
+{
+	pthread_mutex_lock(&lock);
+	stats.triggered++;
+	if (state != CLIP_IDLE) {
+		stats.missed++;
+		pthread_mutex_unlock(&lock);
+		return FALSE;
+	}
+
+	strncpy(clip_name, filename, sizeof(clip_name)-1);
+	clip_name[sizeof(clip_name)-1] = 0;
+	for (clip_len=0; clip_len<hist_len; clip_len++) {
+		clip_frames[clip_len] = 
+			history[(hist_pos + clip_len) % pre_frames];
+		fpool_ref(pool, clip_frames[clip_len]);
+	}
+	if (clip_len < pre_frames)
+		/* fewer frames since the start, the pre-roll is shorter */
+		stats.truncated++;
+	clip_target = clip_len + post_frames;
+
+	if (clip_target == 0) {
+		state = CLIP_IDLE;
+	} else if (clip_len == clip_target) {
+		state = CLIP_WRITING;
+		pthread_cond_signal(&wakeup);
+	} else {
+		state = CLIP_RECORDING;
+	}
+	pthread_mutex_unlock(&lock);
+	return TRUE;
+} /* clip_trigger */
+
+void clip_get_stats(struct clip_stats *s)
+{
+	pthread_mutex_lock(&lock);
+	*s = stats;
+	pthread_mutex_unlock(&lock);
+}
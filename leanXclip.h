@@ -0,0 +1,52 @@
+/*	leanXclip.h
+	Copyright (C) 2009 Reto Baettig
+	
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2.1 of the License, or (at
+	your option) any later version.
+	
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+	General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*!@file leanXclip.h
+ * @Pre-alarm frame ring and alarm clip capture
+ */
+#ifndef H_LEANXCLIP
+#define H_LEANXCLIP
+
+/* Default frames before and after the trigger stored in a clip, see 
+ * clip_pre and clip_post in leanXalarm.conf. The clip keeps up to 
+ * CLIP_POOL_FRAMES(pre, post) frames of the frame pool referenced, 376x240
+ * BGR24 frames need 270 kB each. No pre-roll by default, it needs every 
+ * frame debayered (LAZY_PICTURES in leanXmain.c). */
+#define CLIP_PRE_FRAMES 0
+#define CLIP_POST_FRAMES 20
+/* The pre-roll of the next clip is kept while a clip is written */
+#define CLIP_POOL_FRAMES(pre, post) (2*(pre) + (post))
+/* Upper bound of CLIP_POOL_FRAMES(), 27 MB of 376x240 BGR24 frames */
+#define CLIP_MAX_POOL_FRAMES 100
+
+struct clip_stats {
+	uint32 triggered;
+	uint32 written;
+	uint32 missed; /* triggers while a clip was still being recorded/written */
+	uint32 truncated; /* clips with a shorter pre-roll than requested */
+	uint32 failed; /* could not write the file */
+};
+
+int clip_init(int pre, int post, struct framepool *pool);
+void clip_stop(void);
+void clip_commit(const void *frame, int size);
+bool clip_wants_frames(void);
+bool clip_trigger(const char *filename);
+void clip_get_stats(struct clip_stats *stats);
+
+#endif
@@ -18,253 +18,961 @@
 
 /*!@file leanXip.c
  * @The ip server for the leanXtogg application
+ *
+ * The server runs on its own thread: the capture loop only publishes the 
+ * frames (ip_send_all()) and wakes the thread through a pipe. The thread 
+ * waits for all sockets at once (epoll, or poll()) and serves them 
+ * non-blocking, so a slow network never stalls the capture.
+ *
+ * Every subscription (format and scale) which at least one client wants 
+ * is a stream. The capture loop asks for them with ip_subscriptions() and
+ * produces each once. The frames of a stream are kept in a few slots with
+ * a sequence number. Every client is sent whole frames; when it has 
+ * finished one, it continues with the newest frame of its stream and the 
+ * frames in between are counted as dropped for this client. A slow client
+ * only pins the slot it is in the middle of; there is a slot for every 
+ * client besides the newest frame and the one being filled, so it never
+ * holds back the others.
+ *
+ * A client selects its stream with a request line of space separated 
+ * options, e.g. "format=grey scale=2 fps=5\n":
+ *   format=bgr24|grey|yuv422|i420	default: the native format
+ *   scale=1|2|4			the picture is decimated by it
+ *   fps=N				at most N (up to 1000) frames per second
+ *   raw				no frame headers
+ * Every frame is then preceded by a struct ip_header, unless raw is given.
+ * It can send a new line at any time, it takes effect with the next frame.
+ * A client which sends nothing within IP_REQUEST_WAIT_MS gets the raw
+ * native stream as before, e.g. nc | mplayer, and so does a client whose
+ * line has an unknown option or a bad value.
  */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <string.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <stdlib.h>
 #include "inc/oscar.h"
 #include "leanXtools.h"
+#include "leanXalgos.h"
 #include "leanXip.h"
 
+/* Wait for the sockets with epoll on Linux. Undefine to use poll(), 
+ * which costs the same for the few clients but rebuilds its list of 
+ * sockets in every wait. */
+#if defined(__linux__)
+	#define IP_EPOLL
+#endif
+
+#if defined(IP_EPOLL)
+	#include <sys/epoll.h>
+#else
+	#include <poll.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+	#define MSG_NOSIGNAL 0
+#endif
+
+/* Longest request line, the rest is ignored */
+#define IP_LINE 100
+
 struct client {
 	int sock;
-	char *r_ptr; /* This client got all the data from wbuf up to this ptr */
+	int stream; /* subscribed to, -1 for none */
+	int slot; /* of the frame being sent, -1 between two frames */
+	int offset; /* bytes of the header and the frame sent */
+	int hdrlen; /* 0 for a raw stream */
+	struct ip_header hdr;
+	uint32 seq; /* of the last frame started or skipped, 0 for none */
+	bool blocked; /* send() would block, wait until it is writeable */
+	bool started; /* sent a request or waited long enough */
+	uint32 connected; /* ms */
+	bool raw;
+	uint32 interval; /* ms from frame to frame, 0 for every frame */
+	uint32 next; /* ms, not before */
+
+	/* The last request, taken over between two frames */
+	bool asked; /* a request line was received */
+	bool pending; /* not yet taken over */
+	struct ip_sub want;
+	bool want_raw;
+	uint32 want_interval;
+
+	char line[IP_LINE]; /* being received */
+	int linelen;
 };
 
-struct  client clients[MAX_CLI];
-struct  sockaddr_in addr;
-int	srv_sock;
-char	data[DATABUF];	
+struct ip_frame {
+	uint32 seq; /* 0 for an empty slot */
+	char *data;
+	int len;
+	uint16 width, height;
+	struct timeval time;
+	struct framepool *pool; /* of data, NULL if data is the copy */
+	char *copy; /* buffer for frames which are not in a pool */
+	int copysize;
+	int readers; /* clients in the middle of the frame */
+};
 
-struct ringbuf wbuf;
+struct ip_stream {
+	struct ip_sub sub;
+	int subscribers; /* 0 for a free stream */
+	int latest; /* slot of the newest frame, -1 for none */
+	uint32 seq; /* of the newest frame */
+	struct ip_frame frames[IP_SLOTS];
+};
 
-int ip_start_server()
-{
-	int err;
-	int i;
+/* Readiness of a socket as returned by ip_wait() */
+#define EV_SERVER -1
+#define EV_WAKEUP -2
 
-	srv_sock=socket(PF_INET, SOCK_STREAM, 0);
-	if (srv_sock==SOCK_ERROR) 
-		fatalerror("Could not start IP server\n");
+struct ip_event {
+	int who; /* client index, EV_SERVER or EV_WAKEUP */
+	bool in; /* readable, closed or failed */
+	bool out; /* writeable */
+};
 
-	i=1;
-	setsockopt(srv_sock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(int));
-	i=1024*512;
-	setsockopt(srv_sock, SOL_SOCKET, SO_SNDBUF, &i, sizeof(int));
+/* Names of the request line, by enum pic_format */
+static const char *format_names[] = { "bgr24", "grey", "yuv422", "i420" };
 
-	bzero(&addr, sizeof(addr));
-	addr.sin_port = htons(PORT);
-	addr.sin_family = AF_INET;
+struct  client clients[MAX_CLI];
+struct  sockaddr_in addr;
+int	srv_sock;
 
-	err = bind(srv_sock, (struct sockaddr*)&addr, sizeof(addr));
-	if (srv_sock==SOCK_ERROR) 
-		fatalerror("Could bind socket\n");
+static struct ip_stream streams[IP_STREAMS];
+static struct ip_frame *filling; /* by ip_send_all() */
+static struct ip_sub native; /* for clients without a request */
+static uint32 offered; /* formats, bit (1 << enum pic_format) */
+static int maxscale;
 
-	err = listen(srv_sock, MAX_CLI);
+static int wake[2]; /* pipe to wake the server thread */
+static bool stop;
+static struct ip_stats stats;
+static uint32 syscalls; /* of the server thread, not yet in stats */
 
-	ring_init(&wbuf, SENDBUF);
+static pthread_t worker;
+/* Protects the streams and the slot assignment (seq, readers, latest, 
+ * filling and the stream, slot and seq of the clients), stop and stats. 
+ * The frame data is accessed without it: a slot is only refilled while it
+ * has no readers and is not the latest. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-	for (i=0; i<MAX_CLI; i++)
-		clients[i].sock = -1;
+#if defined(IP_EPOLL)
+static int epfd;
 
-	return 0;
-} /* ip_start_server */
+static void ip_watch(int fd, int who, uint32 events)
+{
+	struct epoll_event ev;
 
-int ip_stop_server()
-{ 
-	int i;
-	for (i=0; i<MAX_CLI; i++) 
-		if (clients[i].sock >0) 
-			close(clients[i].sock);
-	close(srv_sock);
-	return 0;
-} /* ip_stop_server */
+	ev.events = events;
+	ev.data.u32 = who - EV_WAKEUP; /* not negative */
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		OscLog(ERROR, "epoll_ctl failed\n");
+}
 
 /*
- * select_readable
+ * ip_wait
+ *
+ * Waits until one of the sockets or the wakeup pipe is ready, at most 
+ * timeout ms (-1 for no limit). The clients are watched edge triggered: 
+ * they are read and written until they would block, and only reported 
+ * again when that changed.
  *
- * Checks whether the filedescriptor is readable
- * 
- * Return value: true, if readable 
- */ 
-bool select_readable(int fd)
-{ 	
-	int retval;
-	fd_set r;
-	struct timeval timeout;
+ * Return value: the number of events in ev
+ */
+static int ip_wait(struct ip_event *ev, int timeout)
+{
+	struct epoll_event e[MAX_CLI+2];
+	int i, n;
+
+	n = epoll_wait(epfd, e, MAX_CLI+2, timeout);
+	syscalls++;
+	for (i=0; i<n; i++) {
+		ev[i].who = (int)e[i].data.u32 + EV_WAKEUP;
+		ev[i].in = (e[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) != 0;
+		ev[i].out = (e[i].events & EPOLLOUT) != 0;
+	}
+	return max(n, 0);
+}
+#else
+static int ip_wait(struct ip_event *ev, int timeout)
+{
+	struct pollfd fds[MAX_CLI+2];
+	int who[MAX_CLI+2];
+	int i, n, k;
+
+	fds[0].fd = srv_sock;
+	who[0] = EV_SERVER;
+	fds[1].fd = wake[0];
+	who[1] = EV_WAKEUP;
+	fds[0].events = fds[1].events = POLLIN;
+	for (i=0, n=2; i<MAX_CLI; i++) if (clients[i].sock != -1) {
+		fds[n].fd = clients[i].sock;
+		fds[n].events = POLLIN | (clients[i].blocked ? POLLOUT : 0);
+		who[n++] = i;
+	}
 
-	bzero(&timeout, sizeof(timeout));
-	FD_ZERO(&r); 
+	k = poll(fds, n, timeout);
+	syscalls++;
+	for (i=0, k=0; i<n; i++) if (fds[i].revents) {
+		ev[k].who = who[i];
+		ev[k].in = (fds[i].revents & (POLLIN|POLLERR|POLLHUP)) != 0;
+		ev[k].out = (fds[i].revents & POLLOUT) != 0;
+		k++;
+	}
+	return k;
+}
+#endif
 
-	FD_SET(fd, &r);
-	retval = select(fd+1, &r, NULL, NULL, &timeout);
+static int set_nonblocking(int fd)
+{
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
 
-	if (retval == -1) 
-		OscLog(ERROR, "Select Error\n");
+static uint32 now_ms(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1000 + t.tv_nsec/1000000;
+}
 
-	if ((retval>0) && FD_ISSET(fd, &r)) 
-		return TRUE;
+static bool same_sub(const struct ip_sub *a, const struct ip_sub *b)
+{
+	return a->format == b->format && a->scale == b->scale;
+}
 
-	return FALSE;
+/* Drops the frame of a slot, call with lock held */
+static void frame_release(struct ip_frame *f)
+{
+	if (f->pool != NULL)
+		fpool_unref(f->pool, f->data);
+	f->pool = NULL;
+	f->seq = 0;
 }
 
 /*
- * select_writeable
+ * stream_attach
  *
- * Checks whether the filedescriptor is writeable 
- * 
- * Return value: true, if readable 
- */ 
-bool select_writeable(int fd)
-{ 	
-	int retval;
-	fd_set w;
-	struct timeval timeout;
-
-	bzero(&timeout, sizeof(timeout));
-	FD_ZERO(&w); 
-
-	FD_SET(fd, &w);
-	retval = select(fd+1, NULL, &w, NULL, &timeout);
+ * Subscribes to the stream of sub, a new one if nobody has it yet. Call
+ * with lock held.
+ *
+ * Return value: the stream, -1 if all are in use
+ */
+static int stream_attach(const struct ip_sub *sub)
+{
+	int i, unused = -1;
 
-	if (retval == -1) 
-		OscLog(ERROR, "Select Error\n");
+	for (i=0; i<IP_STREAMS; i++) {
+		if (streams[i].subscribers > 0 && same_sub(&streams[i].sub, sub)) {
+			streams[i].subscribers++;
+			return i;
+		}
+		if (streams[i].subscribers == 0 && unused == -1)
+			unused = i;
+	}
+	if (unused != -1) {
+		streams[unused].sub = *sub;
+		streams[unused].subscribers = 1;
+		streams[unused].latest = -1;
+	}
+	return unused;
+}
 
-	if ((retval>0) && FD_ISSET(fd, &w)) 
-		return TRUE;
+/* Unsubscribes, the last one frees the frames. Call with lock held. */
+static void stream_detach(int stream)
+{
+	struct ip_stream *s = &streams[stream];
+	int i;
 
-	return FALSE;
+	if (--s->subscribers > 0)
+		return;
+	for (i=0; i<IP_SLOTS; i++)
+		if (&s->frames[i] != filling)
+			frame_release(&s->frames[i]);
+	s->latest = -1;
 }
 
 void ip_cli_connect() 
 {
 	int i;
+	int sock;
 
-	for (i=0; i<MAX_CLI; i++) {
-		if (clients[i].sock == -1)
-			break;
-	}
-	if (i== MAX_CLI) {
-		OscLog(INFO, "To many clients\n");
-		return;
+	/* Accept all pending connections */
+	while (TRUE) {
+		sock = accept(srv_sock, NULL, 0);
+		syscalls++;
+		if (sock == SOCK_ERROR) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				OscLog(ERROR, "accept failed\n");
+			return;
+		}
+
+		for (i=0; i<MAX_CLI; i++) {
+			if (clients[i].sock == -1)
+				break;
+		}
+		if (i== MAX_CLI) {
+			OscLog(INFO, "To many clients\n");
+			close(sock);
+			continue;
+		}
+
+		OscLog(DEBUG, "New client connects to IP server\n");
+		set_nonblocking(sock);
+		memset(&clients[i], 0, sizeof(clients[i]));
+		clients[i].sock = sock;
+		clients[i].stream = -1;
+		clients[i].slot = -1;
+		clients[i].connected = now_ms();
+		/* The raw native stream unless it sends a request */
+		clients[i].pending = TRUE;
+		clients[i].want = native;
+		clients[i].want_raw = TRUE;
+		#if defined(IP_EPOLL)
+			ip_watch(sock, i, EPOLLIN | EPOLLOUT | EPOLLET);
+		#endif
+		pthread_mutex_lock(&lock);
+		stats.clients++;
+		memset(&stats.client[i], 0, sizeof(stats.client[i]));
+		stats.client[i].connected = TRUE;
+		pthread_mutex_unlock(&lock);
 	}
-	
-	OscLog(DEBUG, "New client connects to IP server\n");
-	clients[i].sock=accept(srv_sock, NULL, 0);
-	if (clients[i].sock==SOCK_ERROR)
-		fatalerror("accept failed\n");
-	clients[i].r_ptr = wbuf.r_ptr;
 }
 
 void ip_cli_disconnect(int client) 
 {
-	clients[client].sock = -1;
+	struct client *cli = &clients[client];
+
+	close(cli->sock);
+	cli->sock = -1;
+	pthread_mutex_lock(&lock);
+	if (cli->slot != -1)
+		streams[cli->stream].frames[cli->slot].readers--;
+	cli->slot = -1;
+	if (cli->stream != -1)
+		stream_detach(cli->stream);
+	cli->stream = -1;
+	stats.clients--;
+	stats.client[client].connected = FALSE;
+	pthread_mutex_unlock(&lock);
 }
 
-void ip_read(int client)
+/*
+ * request_int
+ * Parses the whole option value into *out if it lies in lo..hi.
+ * Return value: false if it is no number or out of range
+ */
+static bool request_int(const char *value, int lo, int hi, int *out)
 {
-	int err;
-	char dummy[100];
-	
-	err=read(clients[client].sock, &dummy, sizeof(dummy)-1);
-	if (err==0) {
-		ip_cli_disconnect(client);
-		OscLog(DEBUG, "Client disconnected\n");
+	char *end;
+	long n = strtol(value, &end, 10);
+
+	if (end == value || *end != 0 || n < lo || n > hi)
+		return FALSE;
+	*out = n;
+	return TRUE;
+}
+
+/*
+ * ip_request
+ *
+ * Parses a request line of the client, see the top of this file. An 
+ * invalid request is rejected as a whole, the client gets the raw native
+ * stream.
+ */
+static void ip_request(int client, char *line)
+{
+	struct client *cli = &clients[client];
+	struct ip_sub want = native;
+	bool raw = FALSE;
+	int fps = 0;
+	bool ok = TRUE;
+	char *tok, *save;
+	int i, val = 0;
+
+	for (tok = strtok_r(line, " \t\r", &save); tok != NULL && ok; 
+	     tok = strtok_r(NULL, " \t\r", &save)) {
+		if (strncmp(tok, "format=", 7) == 0) {
+			for (i=0; i<sizeof(format_names)/sizeof(format_names[0]); i++)
+				if (strcmp(tok+7, format_names[i]) == 0)
+					break;
+			ok = i < sizeof(format_names)/sizeof(format_names[0]) &&
+				(offered & (1 << i));
+			want.format = i;
+		} else if (strncmp(tok, "scale=", 6) == 0) {
+			ok = request_int(tok+6, 1, maxscale, &val) &&
+				(val == 1 || val == 2 || val == 4);
+			want.scale = val;
+		} else if (strncmp(tok, "fps=", 4) == 0) {
+			ok = request_int(tok+4, 0, 1000, &val);
+			fps = val;
+		} else if (strcmp(tok, "raw") == 0) {
+			raw = TRUE;
+		} else {
+			ok = FALSE;
+		}
 	}
-	if (err>0) {
-		dummy[err]=0;
-		printf(dummy);
+	if (!ok) {
+		OscLog(INFO, "Invalid stream request, sending the raw stream\n");
+		want = native;
+		raw = TRUE;
+		fps = 0;
 	}
+	cli->asked = TRUE;
+	cli->pending = TRUE;
+	cli->want = want;
+	cli->want_raw = raw;
+	cli->want_interval = fps > 0 ? 1000/fps : 0;
 }
 
-int ip_send_all(char *buf, int len)
+void ip_read(int client)
 {
-	if (ring_free(&wbuf) > len) 
-		return ring_write(&wbuf, buf, len);
-	else 
-		return 0;
+	struct client *cli = &clients[client];
+	int err, i;
+	char buf[100];
+	
+	/* Until it would block, the clients are edge triggered */
+	while (cli->sock != -1) {
+		err=read(cli->sock, buf, sizeof(buf));
+		syscalls++;
+		/* Interrupted: the rest would not be reported again */
+		if (err<0 && errno == EINTR)
+			continue;
+		if (err==0 || (err<0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			ip_cli_disconnect(client);
+			OscLog(DEBUG, "Client disconnected\n");
+		}
+		if (err<0)
+			return;
+		for (i=0; i<err; i++) {
+			if (buf[i] == '\n') {
+				cli->line[cli->linelen] = 0;
+				ip_request(client, cli->line);
+				cli->linelen = 0;
+			} else if (cli->linelen < IP_LINE-1) {
+				cli->line[cli->linelen++] = buf[i];
+			}
+		}
+	}
 }
 
-void fix_readpointer() {
-	char *minptr;
-	char *rptr;
-	bool hasclient = FALSE;
-	int i;
+/*
+ * client_next
+ *
+ * Between two frames: takes over a pending request and starts the newest
+ * frame of the stream of the client, if it did not get it yet and its 
+ * frame rate allows. Call with lock held.
+ *
+ * Return value: true if a frame was started
+ */
+static bool client_next(int client)
+{
+	struct client *cli = &clients[client];
+	struct ip_stream *s;
+	struct ip_frame *f;
+	uint32 now = now_ms();
+	int k;
+
+	if (!cli->started) {
+		if (!cli->asked && (int32)(now - cli->connected) < 
+		    IP_REQUEST_WAIT_MS)
+			return FALSE;
+		cli->started = TRUE;
+	}
+	if (cli->pending) {
+		k = stream_attach(&cli->want);
+		if (k == -1)
+			return FALSE; /* try again with the next frame */
+		if (cli->stream != -1)
+			stream_detach(cli->stream);
+		cli->stream = k;
+		cli->seq = 0;
+		cli->raw = cli->want_raw;
+		cli->interval = cli->want_interval;
+		cli->next = now;
+		cli->pending = FALSE;
+		stats.client[client].sub = cli->want;
+	}
 
-	minptr = wbuf.w_ptr;
+	s = &streams[cli->stream];
+	if (s->latest == -1 || s->frames[s->latest].seq == cli->seq)
+		return FALSE;
+	f = &s->frames[s->latest];
+	if (cli->interval > 0) {
+		if ((int32)(now - cli->next) < 0) {
+			cli->seq = f->seq; /* skipped, not dropped */
+			return FALSE;
+		}
+		/* More than one interval late: start over */
+		if ((int32)(now - cli->next) > (int32)cli->interval)
+			cli->next = now;
+		cli->next += cli->interval;
+	}
+	if (cli->seq != 0)
+		stats.client[client].dropped += f->seq - cli->seq - 1;
+
+	cli->slot = s->latest;
+	cli->seq = f->seq;
+	cli->offset = 0;
+	f->readers++;
+	if (cli->raw) {
+		cli->hdrlen = 0;
+	} else {
+		cli->hdrlen = sizeof(struct ip_header);
+		cli->hdr.magic = htonl(IP_MAGIC);
+		cli->hdr.seq = htonl(f->seq);
+		cli->hdr.sec = htonl(f->time.tv_sec);
+		cli->hdr.usec = htonl(f->time.tv_usec);
+		cli->hdr.format = htons(s->sub.format);
+		cli->hdr.width = htons(f->width);
+		cli->hdr.height = htons(f->height);
+		cli->hdr.scale = htons(s->sub.scale);
+		cli->hdr.length = htonl(f->len);
+	}
+	return TRUE;
+}
 
-	for (i=0; i<MAX_CLI; i++) if (clients[i].sock>0 ) {
-		hasclient = TRUE;
-		rptr = clients[i].r_ptr;
-		if (rptr > wbuf.w_ptr)
-			rptr -= wbuf.size;
-		minptr = min(minptr, rptr);
+/*
+ * ip_write
+ *
+ * Sends frames to the client, each with its header, until the socket 
+ * would block or it got the newest frame.
+ */
+static void ip_write(int client)
+{
+	struct client *cli = &clients[client];
+	struct ip_frame *f;
+	struct iovec iov[2];
+	struct msghdr msg;
+	int len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while (TRUE) {
+		pthread_mutex_lock(&lock);
+		if (cli->slot == -1 && !client_next(client)) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		f = &streams[cli->stream].frames[cli->slot];
+		pthread_mutex_unlock(&lock);
+
+		if (cli->offset < cli->hdrlen) {
+			iov[0].iov_base = (char *)&cli->hdr + cli->offset;
+			iov[0].iov_len = cli->hdrlen - cli->offset;
+			iov[1].iov_base = f->data;
+			iov[1].iov_len = f->len;
+			msg.msg_iovlen = 2;
+		} else {
+			iov[0].iov_base = f->data + cli->offset - cli->hdrlen;
+			iov[0].iov_len = f->len - (cli->offset - cli->hdrlen);
+			msg.msg_iovlen = 1;
+		}
+		len = sendmsg(cli->sock, &msg, MSG_NOSIGNAL);
+		syscalls++;
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				cli->blocked = TRUE;
+			else {
+				ip_cli_disconnect(client);
+				OscLog(DEBUG, "Client disconnected\n");
+			}
+			return;
+		}
+		cli->offset += len;
+		if (cli->offset == cli->hdrlen + f->len) {
+			pthread_mutex_lock(&lock);
+			f->readers--;
+			cli->slot = -1;
+			stats.client[client].sent++;
+			pthread_mutex_unlock(&lock);
+		}
 	}
+}
 
-	if (minptr < wbuf.data)
-		minptr+=wbuf.size;
-	if (hasclient) wbuf.r_ptr = minptr;
+/*
+ * ip_subscriptions
+ *
+ * The streams which at least one client wants, each once, in subs of 
+ * IP_STREAMS entries.
+ *
+ * Return value: the number of subscriptions
+ */
+int ip_subscriptions(struct ip_sub *subs)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&lock);
+	for (i=0; i<IP_STREAMS; i++)
+		if (streams[i].subscribers > 0)
+			subs[n++] = streams[i].sub;
+	pthread_mutex_unlock(&lock);
+	return n;
 }
-	
-void ip_do_work()
+
+/*
+ * ip_send_all
+ *
+ * Publishes a frame of len bytes of the stream sub, taken at time, to its
+ * clients. pic gives the size for the headers. If pool is not NULL, the 
+ * data is a frame of the pool and a reference is kept as long as it is 
+ * needed, else a copy. Only to be called from one thread (the capture 
+ * loop).
+ *
+ * Return value: len, 0 if nobody wants sub
+ */
+int ip_send_all(const struct ip_sub *sub, const struct OSC_PICTURE *pic, 
+		int len, const struct timeval *time, struct framepool *pool)
 {
-	int i, len;
+	struct ip_stream *s = NULL;
+	struct ip_frame *f = NULL;
+	int i;
 
-	if (select_readable(srv_sock)) {
-		ip_cli_connect();
+	pthread_mutex_lock(&lock);
+	for (i=0; i<IP_STREAMS; i++) {
+		if (streams[i].subscribers > 0 && same_sub(&streams[i].sub, sub)) {
+			s = &streams[i];
+			break;
+		}
 	}
-	
-	for (i=0; i<MAX_CLI; i++) if (clients[i].sock>0 ) {
-
-		while ((clients[i].r_ptr != wbuf.w_ptr) && select_writeable(clients[i].sock)){
-			len = ring_peekfrom(&wbuf, clients[i].r_ptr, data, DATABUF);
-			len = send(clients[i].sock, data, len, 0);
-			if (len>0)
-				ring_addtoptr(&wbuf, &(clients[i].r_ptr), len);
+	if (s == NULL) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	stats.frames++;
+	for (i=0; i<IP_SLOTS; i++) {
+		if (i != s->latest && s->frames[i].readers == 0) {
+			f = &s->frames[i];
+			break;
 		}
-		while ((clients[i].sock>0) && select_readable(clients[i].sock)) {
-			ip_read(i);
-		} 
 	}
+	/* can not happen, there are more slots than clients */
+	if (f == NULL) {
+		stats.dropped++;
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	/* Not looked at by the server thread until it is the latest */
+	f->seq = 0;
+	filling = f;
+	pthread_mutex_unlock(&lock);
+
+	if (f->pool != NULL)
+		fpool_unref(f->pool, f->data);
+	f->pool = pool;
+	if (pool != NULL) {
+		fpool_ref(pool, pic->data);
+		f->data = pic->data;
+	} else {
+		if (f->copysize < len) {
+			free(f->copy);
+			f->copy = malloc(len);
+			if (f->copy == NULL)
+				fatalerror("Did not get memory\n");
+			f->copysize = len;
+		}
+		memcpy(f->copy, pic->data, len);
+		f->data = f->copy;
+	}
+	f->len = len;
+	f->width = pic->width;
+	f->height = pic->height;
+	f->time = *time;
+
+	pthread_mutex_lock(&lock);
+	filling = NULL;
+	/* The last client may have left meanwhile */
+	if (s->subscribers == 0 || !same_sub(&s->sub, sub)) {
+		frame_release(f);
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	f->seq = ++s->seq;
+	s->latest = f - s->frames;
+	stats.syscalls++; /* the wakeup */
+	pthread_mutex_unlock(&lock);
 
-	fix_readpointer();
-	
+	if (write(wake[1], "", 1) < 0 && errno != EAGAIN)
+		OscLog(ERROR, "Could not wake the IP server\n");
+	return len;
 }
 
+static void *ip_worker(void *arg)
+{
+	struct ip_event ev[MAX_CLI+2];
+	char buf[64];
+	bool done = FALSE;
+	int i, n, timeout;
+	int32 left;
+
+	while (!done) {
+		/* Wake up for the clients which wait for their first frame */
+		timeout = -1;
+		for (i=0; i<MAX_CLI; i++) if (clients[i].sock != -1) {
+			if (!clients[i].started) {
+				left = clients[i].connected + IP_REQUEST_WAIT_MS - 
+					now_ms();
+				left = max(left, 0);
+			} else if (clients[i].pending) {
+				left = IP_REQUEST_WAIT_MS;
+			} else {
+				continue;
+			}
+			timeout = timeout == -1 ? left : min(timeout, left);
+		}
+		n = ip_wait(ev, timeout);
+		for (i=0; i<n; i++) {
+			if (ev[i].who == EV_SERVER) {
+				ip_cli_connect();
+			} else if (ev[i].who == EV_WAKEUP) {
+				/* Level triggered, the rest comes next time */
+				read(wake[0], buf, sizeof(buf));
+				syscalls++;
+			} else if (clients[ev[i].who].sock != -1) {
+				if (ev[i].out)
+					clients[ev[i].who].blocked = FALSE;
+				if (ev[i].in)
+					ip_read(ev[i].who);
+			}
+		}
 
-uint32 ip_sendtest() 
+		for (i=0; i<MAX_CLI; i++) 
+			if (clients[i].sock != -1 && !clients[i].blocked)
+				ip_write(i);
+
+		pthread_mutex_lock(&lock);
+		stats.syscalls += syscalls;
+		syscalls = 0;
+		done = stop;
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+/*
+ * ip_start_server
+ *
+ * Starts the server thread. Clients without a request get the raw stream
+ * of sub; they can ask for the formats in the bit mask formats (bit 
+ * 1 << enum pic_format) and a scale of up to maxscale.
+ *
+ * Return value: 0 on success
+ */
+int ip_start_server(const struct ip_sub *sub, uint32 formats, int scale)
 {
-	uint32 len=0;
-	int retval;
+	int err;
 	int i;
 
-	for (i=0; i<MAX_CLI; i++) { 
-		
-		if (clients[i].sock>0) {
-			retval=send(clients[i].sock, data, DATABUF, 0);	
-			if (retval>0)
-				len+=retval;
-		}
+	srv_sock=socket(PF_INET, SOCK_STREAM, 0);
+	if (srv_sock==SOCK_ERROR) 
+		fatalerror("Could not start IP server\n");
+
+	i=1;
+	setsockopt(srv_sock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(int));
+	i=1024*512;
+	setsockopt(srv_sock, SOL_SOCKET, SO_SNDBUF, &i, sizeof(int));
 
+	bzero(&addr, sizeof(addr));
+	addr.sin_port = htons(PORT);
+	addr.sin_family = AF_INET;
+
+	err = bind(srv_sock, (struct sockaddr*)&addr, sizeof(addr));
+	if (err==SOCK_ERROR) 
+		fatalerror("Could bind socket\n");
+
+	err = listen(srv_sock, MAX_CLI);
+	set_nonblocking(srv_sock);
+
+	if (pipe(wake) != 0)
+		fatalerror("Could not create a pipe\n");
+	set_nonblocking(wake[0]);
+	set_nonblocking(wake[1]);
+
+	#if defined(IP_EPOLL)
+		epfd = epoll_create(MAX_CLI+2);
+		if (epfd == -1)
+			fatalerror("Could not create epoll instance\n");
+		ip_watch(srv_sock, EV_SERVER, EPOLLIN);
+		ip_watch(wake[0], EV_WAKEUP, EPOLLIN);
+	#endif
+
+	for (i=0; i<MAX_CLI; i++)
+		clients[i].sock = -1;
+	memset(streams, 0, sizeof(streams));
+	filling = NULL;
+	native = *sub;
+	offered = formats | (1 << sub->format);
+	maxscale = scale;
+	memset(&stats, 0, sizeof(stats));
+	syscalls = 0;
+	stop = FALSE;
+
+	if (pthread_create(&worker, NULL, ip_worker, NULL) != 0) {
+		OscLog(ERROR, "Could not start the IP server thread\n");
+		return -1;
 	}
-	return len;
+	return 0;
+} /* ip_start_server */
+
+int ip_stop_server()
+{ 
+	int i;
+
+	pthread_mutex_lock(&lock);
+	stop = TRUE;
+	pthread_mutex_unlock(&lock);
+	write(wake[1], "", 1);
+	pthread_join(worker, NULL);
+
+	for (i=0; i<MAX_CLI; i++) 
+		if (clients[i].sock != -1) 
+			close(clients[i].sock);
+	close(srv_sock);
+	#if defined(IP_EPOLL)
+		close(epfd);
+	#endif
+	close(wake[0]);
+	close(wake[1]);
+	for (i=0; i<IP_STREAMS*IP_SLOTS; i++) {
+		frame_release(&streams[i/IP_SLOTS].frames[i%IP_SLOTS]);
+		free(streams[i/IP_SLOTS].frames[i%IP_SLOTS].copy);
+	}
+	return 0;
+} /* ip_stop_server */
+
+void ip_get_stats(struct ip_stats *s)
+{
+	pthread_mutex_lock(&lock);
+	*s = stats;
+	pthread_mutex_unlock(&lock);
 }
 
 
-void ip_test() {
-	int i=0;
-	char s[100];
-	while (1) {
-		ip_do_work();
-		sleep(1);
-		sprintf(s, "i=%i\n", i);
-		i=i+1;
-		ip_send_all(s, strlen(s)+1);
+#if defined(OSC_HOST)
+/***************************************************************************/
+/* ip_bench: the cost of the server with local clients                     */
+/***************************************************************************/
+struct bench_client {
+	pthread_t thread;
+	double bytes; /* received */
+};
+
+/* Reads until the server closes the connection */
+static void *bench_client(void *arg)
+{
+	struct bench_client *c = arg;
+	struct sockaddr_in srv;
+	char buf[16384];
+	int sock, n;
+
+	sock = socket(PF_INET, SOCK_STREAM, 0);
+	bzero(&srv, sizeof(srv));
+	srv.sin_family = AF_INET;
+	srv.sin_port = htons(PORT);
+	srv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(sock, (struct sockaddr *)&srv, sizeof(srv)) != 0) {
+		printf("client could not connect\n");
+		close(sock);
+		return NULL;
 	}
+	while ((n = read(sock, buf, sizeof(buf))) > 0)
+		c->bytes += n;
+	close(sock);
+	return NULL;
+}
+
+static double seconds(clockid_t clock)
+{
+	struct timespec t;
+	clock_gettime(clock, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
 }
 
+/*
+ * ip_bench
+ *
+ * Streams frames of the size of the decimated BGR picture at 100 fps to 
+ * local raw clients and prints the syscalls per frame and the CPU time of
+ * the server thread and the whole process (including the clients).
+ */
+void ip_bench(int nclients)
+{
+	const int frames = 500, framesize = 376*240*3, period_us = 10000;
+	const struct ip_sub sub = { PIC_BGR24, 1 };
+	struct bench_client *cli;
+	struct framepool pool;
+	struct OSC_PICTURE pic;
+	struct timeval now;
+	struct ip_stats s0, s1;
+	clockid_t srvclock;
+	double t0, t1, srv0, srv1, cpu0, cpu1, bytes;
+	uint32 dropped;
+	int i;
+
+	nclients = max(1, min(nclients, MAX_CLI));
+	cli = calloc(nclients, sizeof(*cli));
+	if (cli == NULL || fpool_init(&pool, IP_SLOTS+1, framesize) != 0)
+		fatalerror("Did not get memory\n");
+	for (i=0; i<IP_SLOTS+1; i++)
+		memset(pool.items[i].data, 0x55, pool.slotsize);
+
+	pic.width = 376;
+	pic.height = 240;
+	pic.type = OSC_PICTURE_BGR_24;
+
+	ip_start_server(&sub, 0, 1);
+	for (i=0; i<nclients; i++)
+		pthread_create(&cli[i].thread, NULL, bench_client, &cli[i]);
+	/* The clients send no request, they are subscribed after a while */
+	usleep(2*IP_REQUEST_WAIT_MS*1000);
+	ip_get_stats(&s0);
+
+	pthread_getcpuclockid(worker, &srvclock);
+	t0 = seconds(CLOCK_MONOTONIC);
+	srv0 = seconds(srvclock);
+	cpu0 = seconds(CLOCK_PROCESS_CPUTIME_ID);
+	for (i=0; i<frames; i++) {
+		/* As the capture loop, which drops its reference after */
+		pic.data = fpool_get(&pool);
+		gettimeofday(&now, NULL);
+		ip_send_all(&sub, &pic, framesize, &now, &pool);
+		fpool_unref(&pool, pic.data);
+		usleep(period_us);
+	}
+	t1 = seconds(CLOCK_MONOTONIC);
+	srv1 = seconds(srvclock);
+	cpu1 = seconds(CLOCK_PROCESS_CPUTIME_ID);
+	ip_get_stats(&s1);
+
+	ip_stop_server();
+	for (i=0, bytes=0; i<nclients; i++) {
+		pthread_join(cli[i].thread, NULL);
+		bytes += cli[i].bytes;
+	}
+	for (i=0, dropped=0; i<MAX_CLI; i++)
+		dropped += s1.client[i].dropped;
+
+	printf("%d clients, %u frames, %u dropped, %u skipped by clients, "
+	       "%.1f MB received\n", nclients, s1.frames - s0.frames, 
+	       s1.dropped - s0.dropped, dropped, bytes/1e6);
+	printf("%.2f syscalls/frame, server thread %.1f%% CPU, "
+	       "process %.1f%% CPU\n",
+	       (double)(s1.syscalls - s0.syscalls) / (s1.frames - s0.frames),
+	       100*(srv1 - srv0)/(t1 - t0), 100*(cpu1 - cpu0)/(t1 - t0));
+	fpool_cleanup(&pool);
+	free(cli);
+}
+#endif
@@ -17,21 +17,75 @@
 */
 
 /*!@file leanXip.h
- * @Common tools for the leanXtogg application
+ * @The ip server for the leanXtogg application
  */
 #ifndef H_LEANXIP
 #define H_LEANXIP
 
 #define MAX_CLI 10
-#define SENDBUF (1024*512)
-#define DATABUF (1024*512)
+/* Frames kept for the clients: the newest, the next one and one for 
+ * each client which is in the middle of an older frame, so a new frame
+ * always finds a free slot. The native stream only keeps references to
+ * frames of the frame pool. */
+#define IP_SLOTS (MAX_CLI+2)
+/* Different subscriptions (format and scale) served at the same time, 
+ * each is a stream of IP_SLOTS frames */
+#define IP_STREAMS 4
+/* A client which did not send a request line within this time gets the 
+ * raw native stream (legacy clients) */
+#define IP_REQUEST_WAIT_MS 200
 #define PORT 8111
 #define SOCK_ERROR -1
 
-int ip_start_server();
+struct framepool;
+struct timeval;
+
+/* Header in front of every frame of a stream which is not raw, all fields
+ * in network byte order. A client finds the next frame after the length 
+ * or resynchronizes on the magic number. */
+#define IP_MAGIC 0x4c584652 /* "LXFR" */
+
+struct ip_header {
+	uint32 magic;
+	uint32 seq; /* of the stream, a gap means dropped frames */
+	uint32 sec; /* capture time */
+	uint32 usec;
+	uint16 format; /* enum pic_format */
+	uint16 width; /* of the picture, the Y plane for I420 */
+	uint16 height;
+	uint16 scale; /* the stream picture was decimated by it */
+	uint32 length; /* of the frame data which follows */
+};
+
+/* A subscription of clients */
+struct ip_sub {
+	uint16 format; /* enum pic_format */
+	uint16 scale; /* 1, 2 or 4 */
+};
+
+struct ip_stats {
+	uint32 frames; /* passed to ip_send_all() */
+	uint32 dropped; /* no free slot, sent to no client */
+	uint32 clients; /* connected */
+	uint32 syscalls; /* of the server thread and ip_send_all() */
+	struct {
+		bool connected;
+		struct ip_sub sub;
+		uint32 sent; /* frames */
+		uint32 dropped; /* skipped, the client was too slow */
+	} client[MAX_CLI];
+};
+
+int ip_start_server(const struct ip_sub *native, uint32 formats, 
+		    int maxscale);
 int ip_stop_server();
-void ip_do_work();
-int ip_send_all(char *buf, int len);
-uint32 ip_sendtest();
+int ip_subscriptions(struct ip_sub *subs);
+int ip_send_all(const struct ip_sub *sub, const struct OSC_PICTURE *pic, 
+		int len, const struct timeval *time, struct framepool *pool);
+void ip_get_stats(struct ip_stats *stats);
+
+#if defined(OSC_HOST)
+void ip_bench(int clients);
+#endif
 
 #endif
@@ -0,0 +1,377 @@
+/*	leanXjpg.c
+	Copyright (C) 2009 Reto Baettig
+	
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2.1 of the License, or (at
+	your option) any later version.
+	
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+	General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*!@file leanXjpg.c
+ * @Asynchronous JPEG encoding and writing
+ *
+ * The capture loop hands a frame to a background thread which compresses 
+ * it and writes the file: a reference to a frame of the frame pool, else 
+ * a copy in one of the few copy buffers. The frames wait in a bounded 
+ * queue of slots; if all slots or copy buffers are busy, the frame is 
+ * dropped and counted instead of stalling the capture loop.
+ * Raw frames are demosaiced by the encoder as well (jpg_submit_raw()), the
+ * full resolution demosaic takes several times as long as the debayering 
+ * of a frame and would stall the capture loop.
+ * The same queue takes lines of text to be appended to a log file
+ * (jpg_submit_log()), so the capture loop does no file I/O at all and a
+ * line is written after the pictures submitted before it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "inc/oscar.h"
+#include "leanXtools.h"
+#include "leanXalgos.h"
+#include "leanXmotion.h"
+#include "leanXjpg.h"
+
+struct jpg_slot {
+	struct OSC_PICTURE pic;
+	struct framepool *pool; /* pool of pic.data, NULL for a copy */
+	char filename[100];
+	/* pic is a raw frame to be demosaiced, see jpg_submit_raw() */
+	bool raw;
+	struct pic_view view;
+	enum EnBayerOrder order;
+	enum demosaic_mode mode;
+	bool overlay;
+	struct motion_result motion;
+	/* no picture, line is appended to filename, see jpg_submit_log() */
+	bool log;
+	char line[JPG_LINESIZE];
+};
+
+static struct jpg_slot *slots;
+static int numslots;
+static int maxsize;
+static void **copies; /* the free copy buffers are copies[0..freecopies) */
+static int numcopies, freecopies;
+static int head; /* next slot for the worker */
+static int queued; /* slots waiting for the worker, starting at head */
+static bool stop;
+static unsigned char *jpgbuf;
+static struct OSC_PICTURE demosaiced; /* the picture of a raw slot */
+static struct jpg_stats stats;
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+
+/*
+ * write_jpg
+ * Compresses a picture and writes it to a .JPG file. The file is written
+ * under a temporary name and renamed, so the web server never delivers
+ * a partially written picture.
+ *
+ * Return value: 0 on success
+ */
+static int write_jpg(struct OSC_PICTURE *pic, const char *filename)
+{
+	unsigned char *jpgPicEnd;
+	char tmpname[110];
+	FILE *fp;
+	size_t len;
+
+	jpgPicEnd = OscJpgEncode(pic, jpgbuf, JPG_QUALITY);
+	len = jpgPicEnd - jpgbuf;
+
+	sprintf(tmpname, "%s.tmp", filename);
+	fp = fopen(tmpname, "wb");
+	if (fp == NULL)
+		return -1;
+	if (fwrite(jpgbuf, 1, len, fp) != len) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return rename(tmpname, filename);
+}
+
+/*
+ * append_line
+ * Appends a line of text to a log file.
+ *
+ * Return value: 0 on success
+ */
+static int append_line(const char *line, const char *filename)
+{
+	FILE *fp;
+	bool ok;
+
+	fp = fopen(filename, "a");
+	if (fp == NULL)
+		return -1;
+	ok = fputs(line, fp) != EOF;
+	return (fclose(fp) == 0 && ok) ? 0 : -1;
+}
+
+static void *jpg_worker(void *arg)
+{
+	struct jpg_slot *slot;
+	int err;
+
+	pthread_mutex_lock(&lock);
+	while (TRUE) {
+		while (queued == 0 && !stop)
+			pthread_cond_wait(&wakeup, &lock);
+		if (queued == 0)
+			break;
+		slot = &slots[head];
+		pthread_mutex_unlock(&lock);
+
+		if (slot->log) {
+			err = append_line(slot->line, slot->filename);
+		} else if (slot->raw) {
+			err = demosaicBGR(slot->pic, &slot->view, &demosaiced, 
+					  slot->order, slot->mode);
+			if (err == 0 && slot->overlay)
+				motion_overlay(&demosaiced, &slot->motion);
+			if (err == 0)
+				err = write_jpg(&demosaiced, slot->filename);
+		} else {
+			err = write_jpg(&slot->pic, slot->filename);
+		}
+		if (slot->pool != NULL)
+			fpool_unref(slot->pool, slot->pic.data);
+
+		pthread_mutex_lock(&lock);
+		if (!slot->log && slot->pool == NULL)
+			copies[freecopies++] = slot->pic.data;
+		if (err)
+			stats.failed++;
+		else 
+			stats.written++;
+		head = (head+1) % numslots;
+		queued--;
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * jpg_start_worker
+ *
+ * Allocates n slots, ncopies buffers for copies of frames of up to size 
+ * bytes which are not in a frame pool, and starts the encoder.
+ *
+ * Return value: 0 on success
+ */
+int jpg_start_worker(int n, int ncopies, int size)
+{
+	int i;
+
+	slots = malloc(n * sizeof(struct jpg_slot));
+	copies = malloc((ncopies > 0 ? ncopies : 1) * sizeof(void *));
+	jpgbuf = malloc(JPG_BUFSIZE);
+	if (slots == NULL || copies == NULL || jpgbuf == NULL) 
+		fatalerror("Did not get memory\n");
+	for (i=0; i<ncopies; i++) {
+		copies[i] = malloc(size);
+		if (copies[i] == NULL)
+			fatalerror("Did not get memory\n");
+	}
+	numslots = n;
+	numcopies = freecopies = ncopies;
+	maxsize = size;
+	demosaiced.data = NULL;
+	head = queued = 0;
+	stop = FALSE;
+
+	if (pthread_create(&worker, NULL, jpg_worker, NULL) != 0) {
+		OscLog(ERROR, "Could not start the JPEG worker\n");
+		return -1;
+	}
+	return 0;
+} /* jpg_start_worker */
+
+/*
+ * jpg_stop_worker
+ *
+ * Writes the frames still queued and stops the encoder.
+ */
+void jpg_stop_worker(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	stop = TRUE;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+	pthread_join(worker, NULL);
+
+	for (i=0; i<numcopies; i++)
+		free(copies[i]);
+	free(copies);
+	free(demosaiced.data);
+	free(slots);
+	free(jpgbuf);
+} /* jpg_stop_worker */
+
+/*
+ * slot_fill
+ * Takes the slot after the queued ones, which the worker does not touch,
+ * for pic with a reference (pool) or a copy, and fills it in. Only to be
+ * called from the capture loop, the slot is queued with slot_queue().
+ *
+ * Return value: the slot, NULL if the frame had to be dropped
+ */
+static struct jpg_slot *slot_fill(const struct OSC_PICTURE *pic, 
+		struct framepool *pool, const char *filename)
+{
+	struct jpg_slot *slot;
+	int len = pic->width*pic->height*OSC_PICTURE_TYPE_COLOR_DEPTH(pic->type)/8;
+
+	pthread_mutex_lock(&lock);
+	stats.submitted++;
+	if (queued == numslots || 
+	    (pool == NULL && (len > maxsize || freecopies == 0))) {
+		stats.dropped++;
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	slot = &slots[(head+queued) % numslots];
+	if (pool == NULL)
+		slot->pic.data = copies[--freecopies];
+	pthread_mutex_unlock(&lock);
+
+	slot->pool = pool;
+	if (pool != NULL) {
+		fpool_ref(pool, pic->data);
+		slot->pic.data = pic->data;
+	} else {
+		memcpy(slot->pic.data, pic->data, len);
+	}
+	slot->pic.width = pic->width;
+	slot->pic.height = pic->height;
+	slot->pic.type = pic->type;
+	slot->raw = FALSE;
+	slot->log = FALSE;
+	strncpy(slot->filename, filename, sizeof(slot->filename)-1);
+	slot->filename[sizeof(slot->filename)-1] = 0;
+	return slot;
+}
+
+/* slot_queue
+ * Hands the slot filled last to the worker. */
+static void slot_queue(void)
+{
+	pthread_mutex_lock(&lock);
+	queued++;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * jpg_submit
+ *
+ * Queues pic to be compressed and written to filename. If pool is not 
+ * NULL, the data of pic is a frame of the pool and a reference is kept 
+ * until it is written, else a copy. Only to be called from one thread (the
+ * capture loop).
+ *
+ * Return value: false, if the frame had to be dropped
+ */
+bool jpg_submit(const struct OSC_PICTURE *pic, struct framepool *pool, 
+		const char *filename)
+{
+	if (slot_fill(pic, pool, filename) == NULL)
+		return FALSE;
+	slot_queue();
+	return TRUE;
+} /* jpg_submit */
+
+/*
+ * jpg_submit_raw
+ *
+ * Queues a copy of the raw frame to be demosaiced with mode (see 
+ * demosaicBGR(), only the window view if it is not NULL), marked with the
+ * changed tiles of overlay if it is not NULL, compressed and written to 
+ * filename. Takes a copy buffer like jpg_submit() without a pool; the 
+ * BGR24 picture is made in a buffer of the encoder of three times the copy
+ * size, allocated with the first raw frame. Only to be called from the 
+ * capture loop.
+ *
+ * Return value: false, if the frame had to be dropped
+ */
+bool jpg_submit_raw(const struct OSC_PICTURE *raw, const struct pic_view *view,
+		enum EnBayerOrder order, enum demosaic_mode mode, 
+		const struct motion_result *overlay, const char *filename)
+{
+	struct jpg_slot *slot;
+
+	/* The worker only uses it for raw slots, none was queued yet */
+	if (demosaiced.data == NULL) {
+		demosaiced.data = malloc(3 * maxsize);
+		if (demosaiced.data == NULL)
+			fatalerror("Did not get memory\n");
+	}
+	slot = slot_fill(raw, NULL, filename);
+	if (slot == NULL)
+		return FALSE;
+	slot->raw = TRUE;
+	pic_view_clip(&slot->view, raw, view);
+	slot->order = order;
+	slot->mode = mode;
+	slot->overlay = (overlay != NULL);
+	if (overlay != NULL)
+		slot->motion = *overlay;
+	slot_queue();
+	return TRUE;
+} /* jpg_submit_raw */
+
+/*
+ * jpg_submit_log
+ *
+ * Queues line to be appended to the file filename, after the pictures
+ * submitted so far. Only to be called from the capture loop.
+ *
+ * Return value: false, if the line had to be dropped
+ */
+bool jpg_submit_log(const char *line, const char *filename)
+{
+	struct jpg_slot *slot;
+
+	pthread_mutex_lock(&lock);
+	stats.submitted++;
+	if (queued == numslots) {
+		stats.dropped++;
+		pthread_mutex_unlock(&lock);
+		return FALSE;
+	}
+	slot = &slots[(head+queued) % numslots];
+	pthread_mutex_unlock(&lock);
+
+	slot->pool = NULL;
+	slot->raw = FALSE;
+	slot->log = TRUE;
+	strncpy(slot->line, line, sizeof(slot->line)-1);
+	slot->line[sizeof(slot->line)-1] = 0;
+	strncpy(slot->filename, filename, sizeof(slot->filename)-1);
+	slot->filename[sizeof(slot->filename)-1] = 0;
+	slot_queue();
+	return TRUE;
+} /* jpg_submit_log */
+
+void jpg_get_stats(struct jpg_stats *s)
+{
+	pthread_mutex_lock(&lock);
+	*s = stats;
+	pthread_mutex_unlock(&lock);
+}
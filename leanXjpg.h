@@ -0,0 +1,54 @@
+/*	leanXjpg.h
+	Copyright (C) 2009 Reto Baettig
+	
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2.1 of the License, or (at
+	your option) any later version.
+	
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+	General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*!@file leanXjpg.h
+ * @Asynchronous JPEG encoding and writing
+ */
+#ifndef H_LEANXJPG
+#define H_LEANXJPG
+
+/* Number of frames which can wait for the encoder */
+#define JPG_SLOTS 3
+/* Size of the buffer for one compressed picture */
+#define JPG_BUFSIZE 500000
+/* Quality argument passed to OscJpgEncode() */
+#define JPG_QUALITY 1024
+/* Longest line for jpg_submit_log(), including the terminating 0 */
+#define JPG_LINESIZE 256
+
+struct jpg_stats {
+	uint32 submitted; /* pictures and log lines */
+	uint32 written;
+	uint32 dropped; /* no free slot, the frame was not encoded */
+	uint32 failed; /* could not write the file */
+};
+
+struct pic_view;
+struct motion_result;
+
+int jpg_start_worker(int slots, int copies, int maxsize);
+void jpg_stop_worker(void);
+bool jpg_submit(const struct OSC_PICTURE *pic, struct framepool *pool, 
+		const char *filename);
+bool jpg_submit_raw(const struct OSC_PICTURE *raw, const struct pic_view *view,
+		enum EnBayerOrder order, enum demosaic_mode mode, 
+		const struct motion_result *overlay, const char *filename);
+bool jpg_submit_log(const char *line, const char *filename);
+void jpg_get_stats(struct jpg_stats *stats);
+
+#endif
@@ -23,17 +23,101 @@
 #include "leanXalgos.h"
 #include "leanXip.h"
 #include "leanXtools.h"
+#include "leanXjpg.h"
+#include "leanXclip.h"
+#include "leanXpool.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
 
 #define REG_AEC_AGC_ENABLE 0xaf
 #define CAM_REG_RESERVED_0x20 0x20
 #define CAM_REG_CHIP_CONTROL 0x07
 #define BUF_SIZE 1000
 
+/* Fused pipeline: run the motion detection on the decimated luminance
+ * picture which is produced in the same pass as the BGR stream picture.
+ * Undefine to run the detection on the full resolution raw Bayer frame. */
+#define FUSED_PIPELINE
+
+/* Define to stream and record planar YUV 4:2:0 (I420) frames instead of 
+ * BGR24, half the bytes per frame. The motion detection runs on their Y
+ * plane, the live snapshots are greyscale. Clients need format=i420. */
+#undef STREAM_I420
+
+/* Format of the stream picture, sent to the clients which do not ask for
+ * another one. The other formats and scales are converted from it on 
+ * request, which only works from BGR24. */
+#if defined(STREAM_I420)
+	#define STREAM_NATIVE { PIC_I420, 1 }
+	#define STREAM_FORMATS 0
+	#define STREAM_MAX_SCALE 1
+#else
+	#define STREAM_NATIVE { PIC_BGR24, 1 }
+	#define STREAM_FORMATS ((1 << PIC_GREY) | (1 << PIC_YUV422) | \
+				(1 << PIC_I420))
+	#define STREAM_MAX_SCALE 4
+#endif
+
+/* Host builds only: split the debayering and the motion sums of a frame 
+ * into this many bands which run on one thread per CPU, e.g. to replay
+ * recorded streams. Undefine to run the fused pipeline on one thread as
+ * on the leanXcam. */
+#if defined(OSC_HOST) && !defined(STREAM_I420)
+	#define PARALLEL_BANDS 8
+#endif
+
+/* Processing window of the raw frames in sensor pixels { x, y, width, 
+ * height, stride }, a stride of 0 is the frame width. Only the window is
+ * debayered, streamed and watched for motion; it is read in place, a 
+ * smaller window takes proportionally less time. Undefine to process the 
+ * whole frame. */
+#define PROCESS_WINDOW \
+	{ 0, 0, OSC_CAM_MAX_IMAGE_WIDTH, OSC_CAM_MAX_IMAGE_HEIGHT, 0 }
+
+/* Debayer a frame into the stream picture only if somebody needs it: a
+ * client, the live snapshot, an alarm event, or the clips, which need 
+ * every frame unless clip_pre in MOTION_CONFIG_FILE is 0. The other frames
+ * only get the motion detection. Undefine to debayer every frame. */
+#define LAZY_PICTURES
+
+/* Every this many frames the stream picture is the live snapshot */
+#define LIVE_IMAGE_FRAMES 20
+
+/* Mark the changed motion tiles in the stream and snapshot pictures */
+#define MOTION_OVERLAY
+
+/* Alarm snapshots in full sensor resolution, demosaiced with this mode
+ * (DEMOSAIC_BILINEAR or DEMOSAIC_MHC). Undefine to store the decimated 
+ * stream picture instead. */
+#define ALARM_PIC_FULLRES DEMOSAIC_MHC
+
+/* The pictures which wait for the JPEG encoder are frames of the frame 
+ * pool, only the raw peak frame of ALARM_PIC_FULLRES is a copy, which the
+ * encoder demosaics */
+#if defined(ALARM_PIC_FULLRES)
+	#define JPG_COPIES 1
+	#define JPG_COPY_SIZE (OSC_CAM_MAX_IMAGE_WIDTH * OSC_CAM_MAX_IMAGE_HEIGHT)
+#else
+	#define JPG_COPIES 0
+	#define JPG_COPY_SIZE 0
+#endif
+
+/* Frames of the frame pool: the clip frames, the JPEG queue, the stream, 
+ * the frame being processed and the peak frame of an alarm event */
+#define FRAME_POOL_FRAMES(clip) ((clip) + JPG_SLOTS + IP_SLOTS + 2)
+
+/* Motion detection configuration, reloaded on SIGHUP */
+#define MOTION_CONFIG_FILE "leanXalarm.conf"
+
+/* One line per alarm event is appended to this file */
+#define ALARM_LOG_FILE "/home/httpd/alarms.txt"
+
 /*! @brief The framework module dependencies of this application. */
 struct OSC_DEPENDENCY deps[] = {
 	{ "log", OscLogCreate, OscLogDestroy },
@@ -54,8 +138,27 @@ struct SYSTEM {
 	uint8 frameBuffer2[OSC_CAM_MAX_IMAGE_WIDTH * OSC_CAM_MAX_IMAGE_HEIGHT];
 	uint8 doubleBufferIDs[2]; /* The frame buffer IDs of the frame
 				   * buffers creating a double buffer. */
+	enum EnBayerOrder bayerOrder; /* Of the first row, changes with the
+				       * perspective. */
+	struct pic_view window; /* The processed part of the frames */
 } sys;
 
+#if defined(PROCESS_WINDOW)
+	const struct pic_view processWindow = PROCESS_WINDOW;
+#endif
+
+/*! @brief The debayered frames, shared by the stream, the snapshots and 
+ * the clips */
+struct framepool framePool;
+
+/*! @brief Set by SIGHUP, the configuration is reloaded between two frames */
+volatile sig_atomic_t reloadConfig = 0;
+
+void sighup(int sig)
+{
+	reloadConfig = 1;
+}
+
 /*********************************************************************//*!
  * @brief Initialize framework and system parameters
  *
@@ -90,6 +193,7 @@ void initSystem(struct SYSTEM *s)
 
 	OscCamSetAreaOfInterest(0, 0, OSC_CAM_MAX_IMAGE_WIDTH, OSC_CAM_MAX_IMAGE_HEIGHT);
 	OscCamSetupPerspective(OSC_CAM_PERSPECTIVE_180DEG_ROTATE);
+	OscCamGetBayerOrder(&s->bayerOrder, 0, 0);
 
 	OscCamSetFrameBuffer(0, OSC_CAM_MAX_IMAGE_WIDTH * OSC_CAM_MAX_IMAGE_HEIGHT, s->frameBuffer1, TRUE); 
 	OscCamSetFrameBuffer(1, OSC_CAM_MAX_IMAGE_WIDTH * OSC_CAM_MAX_IMAGE_HEIGHT, s->frameBuffer2, TRUE); 
@@ -120,64 +224,280 @@ void cleanupSystem(struct SYSTEM *s)
 } /* cleanupSysteim */
 
 /*********************************************************************//*!
- * @brief Compress debayered BGR Picture and write it to a .JPG file
+ * @brief Append an alarm event to the alarm log
  *
- * Caution: There is no filename checking and no safety net yet ;-)
+ * The line is written by the JPEG encoder thread, after the event snapshot.
  *
- * @param pic A BGR Image
- * @param tmpbuf A temporary buffer for the compression algorithm
- * @param filename The filename where the compressed image has to be stored
+ * @param ev The finished event
+ * @param picname The file name of the event snapshot
  *//*********************************************************************/
-void writeJPG(struct OSC_PICTURE *pic, unsigned char *jpgbuf, char *filename)
+void writeEventLog(const struct alarm_event *ev, const char *picname)
 {
-	unsigned char *jpgPicEnd;
-	FILE *fp;
+	char start[32], end[32], line[JPG_LINESIZE];
+
+	strftime(start, sizeof(start), "%Y-%m-%d %H:%M:%S", 
+		 localtime(&ev->start.tv_sec));
+	strftime(end, sizeof(end), "%H:%M:%S", localtime(&ev->end.tv_sec));
+
+	snprintf(line, sizeof(line), "event %u: %s.%03i - %s.%03i, "
+		"frames %u-%u, peak %u (%i tiles) %s\n", ev->number, 
+		start, (int)(ev->start.tv_usec/1000), 
+		end, (int)(ev->end.tv_usec/1000), 
+		ev->start_frame, ev->end_frame, ev->peak_frame, 
+		ev->peak_changed, picname);
+	jpg_submit_log(line, ALARM_LOG_FILE);
+}
+
+#if defined(PARALLEL_BANDS)
+/*! @brief A frame of the band-parallel pipeline, every band has its own
+ * statistics and tile sums */
+struct frame_job {
+	struct OSC_PICTURE raw;
+	struct OSC_PICTURE *calc;
+	struct OSC_PICTURE *grey;
+	struct OSC_PICTURE greyView; /* Described before the bands run */
+	struct pic_view window;
+	enum EnBayerOrder order;
+	struct ImgStats stats[PARALLEL_BANDS];
+	uint32 sums[PARALLEL_BANDS][MAX_FIELDS];
+} frameJob;
 
-	jpgPicEnd = jpgbuf;
-	jpgPicEnd = OscJpgEncode(pic, jpgbuf, 1024);
+/*********************************************************************//*!
+ * @brief Debayers one band of a frame and takes its motion tile sums
+ *//*********************************************************************/
+void frameBand(void *arg, int band, int bands)
+{
+	struct frame_job *job = arg;
+	const int rows = job->window.h/2;
+
+	fastbinBGRGreyBand(job->raw, &job->window, job->calc, job->grey, job->order, 
+		&job->stats[band], band, bands);
+	memset(job->sums[band], 0, sizeof(job->sums[band]));
+	motion_sums_rows(&job->greyView, NULL, BAND_FIRST(rows, band, bands),
+		BAND_FIRST(rows, band+1, bands), job->sums[band]);
+}
 
-	fp = fopen (filename, "wb");
-	fwrite (jpgbuf, 1, jpgPicEnd - jpgbuf, fp);
-	fclose(fp);
+/*********************************************************************//*!
+ * @brief Band-parallel version of the fused pipeline
+ *
+ * Runs the bands of a frame on the thread pool and merges the statistics
+ * and tile sums in band order, the result is the same as with one thread.
+ *
+ * @return TRUE if the frame is alarming
+ *//*********************************************************************/
+bool parallelFrame(struct OSC_PICTURE *raw, const struct pic_view *window,
+	struct OSC_PICTURE *calc, struct OSC_PICTURE *grey, 
+	enum EnBayerOrder order, struct ImgStats *stats, 
+	struct motion_result *res)
+{
+	struct frame_job *job = &frameJob;
+	uint32 sums[MAX_FIELDS];
+	int band, t;
+
+	job->raw = *raw;
+	pic_view_clip(&job->window, raw, window);
+	job->calc = calc;
+	job->grey = grey;
+	job->greyView = *grey;
+	job->greyView.width = job->window.w/2;
+	job->greyView.height = job->window.h/2;
+	job->greyView.type = OSC_PICTURE_GREYSCALE;
+	job->order = order;
+	for (band=0; band<PARALLEL_BANDS; band++) {
+		job->stats[band].want = stats->want;
+		job->stats[band].tiles_x = stats->tiles_x;
+		job->stats[band].tiles_y = stats->tiles_y;
+	}
+
+	pool_run(frameBand, job, PARALLEL_BANDS);
+
+	stats_merge(stats, job->stats, PARALLEL_BANDS);
+	memset(sums, 0, sizeof(sums));
+	for (band=0; band<PARALLEL_BANDS; band++)
+		for (t=0; t<MAX_FIELDS; t++)
+			sums[t] += job->sums[band][t];
+	return is_alarm_sums(grey, NULL, sums, res);
+}
+#endif /* PARALLEL_BANDS */
+
+#if defined(LAZY_PICTURES)
+/*********************************************************************//*!
+ * @brief The motion detection of a frame without a stream picture
+ *
+ * Only makes the luminance picture the detection of the pipelines in main()
+ * runs on, without the detection on the raw frame the exposure figures
+ * stay those of the last stream picture.
+ *
+ * @return TRUE if the frame is alarming
+ *//*********************************************************************/
+bool motionFrame(struct OSC_PICTURE *raw, struct OSC_PICTURE *grey, 
+	struct ImgStats *stats, struct motion_result *res)
+{
+	#if defined(STREAM_I420)
+		fastbinGrey(*raw, &sys.window, grey, 
+			motion_integral(sys.window.w/2, sys.window.h/2),
+			sys.bayerOrder, stats);
+		return is_alarm_integral(grey, res);
+	#elif defined(FUSED_PIPELINE) || defined(PARALLEL_BANDS)
+		fastbinLuma(*raw, &sys.window, grey, 
+			motion_integral(sys.window.w/2, sys.window.h/2),
+			sys.bayerOrder, stats);
+		return is_alarm_integral(grey, res);
+	#else
+		return is_alarm_view(raw, &sys.window, res);
+	#endif
+}
+
+/*********************************************************************//*!
+ * @brief The stream picture of a frame after its motion detection
+ *//*********************************************************************/
+void streamFrame(struct OSC_PICTURE *raw, struct OSC_PICTURE *calc)
+{
+	#if defined(STREAM_I420)
+		fastbinI420(*raw, &sys.window, calc, NULL, sys.bayerOrder, NULL);
+	#else
+		fastbinBGR(*raw, &sys.window, calc, sys.bayerOrder, NULL);
+	#endif
 }
+#endif /* LAZY_PICTURES */
+
 /*********************************************************************//*!
  * @brief  The main program
  * 
  * Opens the camera and reads pictures as fast as possible
- * Makes a debayering of the image
+ * Makes a debayering of the image, with LAZY_PICTURES only when it is 
+ * needed, and watches it for motion
  * Writes the debayered image to a buffer which can be read by
  * TCP clients on Port 8111. Several concurrent clients are allowed.
  * The simplest streaming video client looks like this:
  * 
  * nc 192.168.1.10 8111 | mplayer - -demuxer rawvideo -rawvideo w=376:h=240:format=bgr24:fps=100
  * 
- * Writes every 10th picture to a .jpg file in the Web Server Directory
+ * Clients can ask for other formats, sizes and frame rates with a request
+ * line, with or without frame headers, see leanXip.c:
+ *
+ * (echo "format=grey scale=2 fps=10 raw"; cat) | nc 192.168.1.10 8111 | mplayer - -demuxer rawvideo -rawvideo w=188:h=120:format=y8:fps=10
+ * 
+ * Writes every LIVE_IMAGE_FRAMES picture to a .jpg file in the Web Server Directory
+ * Writes one .jpg file per alarm event (the frame with the most changed
+ * tiles), a raw video clip of the frames before and after the start of the
+ * event and logs the event
  *//*********************************************************************/
 int main(const int argc, const char * argv[])
 {
 	struct OSC_PICTURE calcPic;
+	struct OSC_PICTURE greyPic;
 	struct OSC_PICTURE rawPic;
-	unsigned char *tmpbuf;
+	struct OSC_PICTURE convPic;
+	const struct ip_sub streamSub = STREAM_NATIVE;
+	struct ip_sub subs[IP_STREAMS];
+	int nsubs, len;
+	bool live, picture;
+	uint32 pictures = 0;
+	#if defined(ALARM_PIC_FULLRES)
+		struct OSC_PICTURE peakRaw;
+		struct motion_result peakMotion;
+	#else
+		struct OSC_PICTURE peakPic;
+	#endif
+	bool alarm;
+	struct motion_result motion;
+	struct alarm_event event;
+	struct timeval now;
+	int flags;
+	struct jpg_stats jpgstats;
+	struct clip_stats clipstats;
+	struct ip_stats ipstats;
+	struct ImgStats imgStats;
 	int loops=0;	
-	int numalarm=0;
+	int poolFrames;
+	int frameBytes;
+	int i;
 	char filename[100];
 	
+	#if defined(OSC_HOST)
+		/* "bench" only times the debayering and exits, it fails if
+		 * the YUV tables are off by more than one */
+		if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+			if (debayer_bench() > 1) {
+				printf("YUV tables inaccurate\n");
+				return 1;
+			}
+			return 0;
+		}
+		/* "ipbench [clients]" times the stream server */
+		if (argc > 1 && strcmp(argv[1], "ipbench") == 0) {
+			ip_bench(argc > 2 ? atoi(argv[2]) : 4);
+			return 0;
+		}
+	#endif
+
 	initSystem(&sys);
 
-	ip_start_server();
+	ip_start_server(&streamSub, STREAM_FORMATS, STREAM_MAX_SCALE);
+	#if defined(PARALLEL_BANDS)
+		OscLog(NOTICE, "%d threads for the frame bands\n", pool_start(0));
+	#endif
 
 	/* setup variables */
 	rawPic.width = OSC_CAM_MAX_IMAGE_WIDTH;
 	rawPic.height = OSC_CAM_MAX_IMAGE_HEIGHT;
 	rawPic.type = OSC_PICTURE_GREYSCALE;
-
-	/* calcPic width, height etc. are set in the debayering algos */
-	calcPic.data = malloc(3 * OSC_CAM_MAX_IMAGE_WIDTH * OSC_CAM_MAX_IMAGE_HEIGHT);
-	if (calcPic.data == 0)
+	#if defined(PROCESS_WINDOW)
+		pic_view_clip(&sys.window, &rawPic, &processWindow);
+	#else
+		pic_view_clip(&sys.window, &rawPic, NULL);
+	#endif
+	OscLog(NOTICE, "processing %ux%u pixels from %u,%u\n", sys.window.w,
+		sys.window.h, sys.window.x, sys.window.y);
+
+	/* The detection runs on the decimated luminance or the raw window,
+	 * the grid of the configuration has to fit it */
+	#if defined(FUSED_PIPELINE) || defined(STREAM_I420) || \
+		defined(PARALLEL_BANDS)
+		motion_picture_size(sys.window.w/2, sys.window.h/2);
+	#else
+		motion_picture_size(sys.window.w, sys.window.h);
+	#endif
+	motion_config_load(MOTION_CONFIG_FILE);
+	signal(SIGHUP, sighup);
+
+	/* calcPic width, height etc. are set in the debayering algos, the 
+	 * data is a new frame of the frame pool in every loop. The clip 
+	 * lengths of the configuration are only taken here. */
+	poolFrames = FRAME_POOL_FRAMES(CLIP_POOL_FRAMES(
+		motion_config()->clip_pre, motion_config()->clip_post));
+	if (fpool_init(&framePool, poolFrames, 
+		       3 * OSC_CAM_MAX_IMAGE_WIDTH/2 * OSC_CAM_MAX_IMAGE_HEIGHT/2) != 0)
+		fatalerror("Did not get memory\n");
+	if (clip_init(motion_config()->clip_pre, motion_config()->clip_post, 
+		      &framePool) != 0)
+		fatalerror("Could not start the clip writer\n");
+	OscLog(NOTICE, "clips of %d+%d frames, %d frames in the pool\n", 
+		motion_config()->clip_pre, motion_config()->clip_post, poolFrames);
+	greyPic.data = malloc(OSC_CAM_MAX_IMAGE_WIDTH/2 * OSC_CAM_MAX_IMAGE_HEIGHT/2);
+	if (greyPic.data == 0)
 		fatalerror("Did not get memory\n");
-	tmpbuf = malloc(500000);
-	if (tmpbuf == 0)
+	/* The stream picture converted for the clients, at most its size */
+	convPic.data = malloc(3 * OSC_CAM_MAX_IMAGE_WIDTH/2 * OSC_CAM_MAX_IMAGE_HEIGHT/2);
+	if (convPic.data == 0)
 		fatalerror("Did not get memory\n");
+	#if defined(ALARM_PIC_FULLRES)
+		/* The raw peak frame of the current alarm event */
+		peakRaw = rawPic;
+		peakRaw.data = malloc(OSC_CAM_MAX_IMAGE_WIDTH * OSC_CAM_MAX_IMAGE_HEIGHT);
+		if (peakRaw.data == 0)
+			fatalerror("Did not get memory\n");
+	#else
+		/* A reference to the peak frame in the frame pool */
+		peakPic.data = NULL;
+	#endif
+	memset(&event, 0, sizeof(event));
+	/* Exposure figures, taken by the debayering pass */
+	memset(&imgStats, 0, sizeof(imgStats));
+	imgStats.want = STATS_MEAN | STATS_CHANNELS | STATS_MINMAX;
+	if (jpg_start_worker(JPG_SLOTS, JPG_COPIES, JPG_COPY_SIZE) != 0)
+		fatalerror("Could not start the JPEG worker\n");
 
 	
 	#if defined(OSC_TARGET)
@@ -188,10 +508,17 @@ int main(const int argc, const char * argv[])
 
 	while(true) {
 
+		if (reloadConfig) {
+			reloadConfig = 0;
+			if (motion_config_load(MOTION_CONFIG_FILE) == 0)
+				OscLog(NOTICE, "Reloaded %s\n", MOTION_CONFIG_FILE);
+		}
+
 		OscCamReadPicture(OSC_CAM_MULTI_BUFFER, (void *) &rawPic.data, 0, 0);
 		/* Take a picture */
 		usleep(2000);
 		OscCamSetupCapture(OSC_CAM_MULTI_BUFFER); 
+		gettimeofday(&now, NULL);
 
 		#if defined(OSC_TARGET)
 			OscGpioTriggerImage();
@@ -199,32 +526,168 @@ int main(const int argc, const char * argv[])
 			usleep(10000);
 		#endif
 
-		if (is_alarm(&rawPic)) {
+		/* The streams the clients subscribed to */
+		nsubs = ip_subscriptions(subs);
+		live = (loops+1) % LIVE_IMAGE_FRAMES == 0;
+		#if defined(LAZY_PICTURES)
+			picture = nsubs > 0 || live || event.state != ALARM_IDLE ||
+				clip_wants_frames();
+		#else
+			picture = TRUE;
+		#endif
+
+		if (picture) {
+			calcPic.data = fpool_get(&framePool);
+			/* can not happen, every consumer keeps a bounded number */
+			if (calcPic.data == NULL)
+				fatalerror("No free frame\n");
+
+			#if defined(STREAM_I420)
+				fastbinI420(rawPic, &sys.window, &calcPic, 
+					motion_integral(sys.window.w/2, sys.window.h/2),
+					sys.bayerOrder, &imgStats);
+				alarm = is_alarm_integral(&calcPic, &motion);
+			#elif defined(PARALLEL_BANDS)
+				alarm = parallelFrame(&rawPic, &sys.window, &calcPic, 
+					&greyPic, sys.bayerOrder, &imgStats, &motion);
+			#elif defined(FUSED_PIPELINE)
+				fastbinBGRGrey(rawPic, &sys.window, &calcPic, &greyPic, 
+					motion_integral(sys.window.w/2, sys.window.h/2),
+					sys.bayerOrder, &imgStats);
+				alarm = is_alarm_integral(&greyPic, &motion);
+			#else
+				alarm = is_alarm_view(&rawPic, &sys.window, &motion);
+				fastbinBGR(rawPic, &sys.window, &calcPic, sys.bayerOrder, 
+					&imgStats);
+			#endif
+		}
+		#if defined(LAZY_PICTURES)
+		else {
+			alarm = motionFrame(&rawPic, &greyPic, &imgStats, &motion);
+			/* An alarm starts an event which needs its picture */
+			if (alarm) {
+				picture = TRUE;
+				calcPic.data = fpool_get(&framePool);
+				if (calcPic.data == NULL)
+					fatalerror("No free frame\n");
+				streamFrame(&rawPic, &calcPic);
+			}
+		}
+		#endif
+
+		if (picture) {
+			pictures++;
+			#if defined(MOTION_OVERLAY)
+				if (motion.changed > 0)
+					motion_overlay(&calcPic, &motion);
+			#endif
+			#if defined(STREAM_I420)
+				frameBytes = YUV420_SIZE(calcPic.width, calcPic.height);
+			#else
+				frameBytes = calcPic.width*calcPic.height*
+					OSC_PICTURE_TYPE_COLOR_DEPTH(calcPic.type)/8;
+			#endif
+			clip_commit(calcPic.data, frameBytes);
+		}
+
+		flags = alarm_event_update(&event, alarm, &motion, loops, &now);
+		if (flags & EVENT_PEAK) {
+			/* Only a copy or a reference, the demosaicing and 
+			 * compression is done once at the end by the encoder */
+			#if defined(ALARM_PIC_FULLRES)
+				memcpy(peakRaw.data, rawPic.data, 
+					rawPic.width*rawPic.height);
+				peakMotion = motion;
+			#else
+				if (peakPic.data != NULL)
+					fpool_unref(&framePool, peakPic.data);
+				peakPic = calcPic;
+				fpool_ref(&framePool, peakPic.data);
+			#endif
+		}
+		if (flags & EVENT_START) {
 			OscGpioSetTestLed(TRUE);
-			printf("alarm\n");
-			sprintf(filename, "/home/httpd/alarm_pic%02i.jpg", numalarm%16);
-			writeJPG(&calcPic, tmpbuf, filename);
-			numalarm++;
-		} else {
+			printf("alarm %u\n", event.number);
+			sprintf(filename, "/home/httpd/alarm_clip%02u.bgr", (event.number-1)%16);
+			clip_trigger(filename);
+		}
+		if (flags & EVENT_END) {
 			OscGpioSetTestLed(FALSE);
+			sprintf(filename, "/home/httpd/alarm_pic%02u.jpg", (event.number-1)%16);
+			#if defined(ALARM_PIC_FULLRES) && defined(MOTION_OVERLAY)
+				jpg_submit_raw(&peakRaw, &sys.window, sys.bayerOrder,
+					ALARM_PIC_FULLRES, &peakMotion, filename);
+			#elif defined(ALARM_PIC_FULLRES)
+				jpg_submit_raw(&peakRaw, &sys.window, sys.bayerOrder,
+					ALARM_PIC_FULLRES, NULL, filename);
+			#else
+				if (peakPic.data != NULL) {
+					jpg_submit(&peakPic, &framePool, filename);
+					fpool_unref(&framePool, peakPic.data);
+					peakPic.data = NULL;
+				}
+			#endif
+			writeEventLog(&event, filename);
 		}
 
-		fastdebayerBGR(rawPic, &calcPic, NULL);
-
-		ip_send_all((char *)calcPic.data, calcPic.width*calcPic.height*
-                        OSC_PICTURE_TYPE_COLOR_DEPTH(calcPic.type)/8);
+		/* Every stream a client subscribed to, each once */
+		for (i=0; i<nsubs && picture; i++) {
+			if (subs[i].format == streamSub.format && subs[i].scale == 1) {
+				ip_send_all(&subs[i], &calcPic, frameBytes, &now, 
+					    &framePool);
+				continue;
+			}
+			len = bgr_convert(&calcPic, &convPic, subs[i].format, 
+					  subs[i].scale);
+			if (len > 0)
+				ip_send_all(&subs[i], &convPic, len, &now, NULL);
+		}
 
 		loops+=1;
-		if (loops%20 == 0) {
-			writeJPG(&calcPic, tmpbuf, "/home/httpd/liveimage.jpg");
+		if (live) {
+			jpg_submit(&calcPic, &framePool, 
+				"/home/httpd/liveimage.jpg");
+		}
+		/* The clips and the encoder keep their own references */
+		if (picture)
+			fpool_unref(&framePool, calcPic.data);
+		if (loops%1000 == 0) {
+			jpg_get_stats(&jpgstats);
+			OscLog(NOTICE, "jpg: %u submitted, %u written, %u dropped, "
+				"%u failed\n", jpgstats.submitted, jpgstats.written,
+				jpgstats.dropped, jpgstats.failed);
+			OscLog(NOTICE, "image: luminance %u (%u..%u), B/G/R %u/%u/%u\n",
+				imgStats.mean_y, imgStats.min_y, imgStats.max_y,
+				imgStats.mean_b, imgStats.mean_g, imgStats.mean_r);
+			clip_get_stats(&clipstats);
+			OscLog(NOTICE, "clips: %u triggered, %u written, %u missed, "
+				"%u truncated, %u failed\n", clipstats.triggered, 
+				clipstats.written, clipstats.missed, clipstats.truncated,
+				clipstats.failed);
+			OscLog(NOTICE, "frames: %d of %d in use, %u pictures of "
+				"%d frames\n", fpool_used(&framePool), 
+				poolFrames, pictures, loops);
+			ip_get_stats(&ipstats);
+			OscLog(NOTICE, "ip: %u clients, %u frames, %u dropped, "
+				"%u syscalls\n", ipstats.clients, ipstats.frames, 
+				ipstats.dropped, ipstats.syscalls);
+			for (i=0; i<MAX_CLI; i++) if (ipstats.client[i].connected)
+				OscLog(NOTICE, "ip client %d: format %u scale %u, "
+					"%u frames sent, %u dropped\n", i, 
+					ipstats.client[i].sub.format, 
+					ipstats.client[i].sub.scale,
+					ipstats.client[i].sent,
+					ipstats.client[i].dropped);
 		}
-
-
-                ip_do_work();
-	
 	}
 
 	ip_stop_server();
+	#if defined(PARALLEL_BANDS)
+		pool_stop();
+	#endif
+	jpg_stop_worker();
+	clip_stop();
+	fpool_cleanup(&framePool);
 
 	cleanupSystem(&sys);
 
@@ -21,85 +21,904 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/time.h>
 #include "inc/oscar.h"
+#include "leanXtools.h"
 #include "leanXmotion.h"
+#include "leanXclip.h"
+
+/* Fixed point fraction bits of the background means */
+#define BG_FRAC 8
+
+/* Range of the configurable detection parameters: zscore^2 times the 
+ * largest variance of bg_update() (255 grey levels with 4 fraction bits,
+ * squared) and the learning rates 1 << shift fit in an int32 */
+#define ZSCORE_MAX 11
+#define DEVIATION_MAX 255
+#define RATE_SHIFT_MAX 15
+
+/* Configuration, double buffered: motion_config_set() fills the buffer 
+ * which is not in use and then switches the pointer, so a new configuration
+ * can be installed while the capture loop is running. Every detection run 
+ * reads the pointer once and uses the same configuration throughout. */
+static struct motion_config Configs[2];
+static struct motion_config * volatile Config;
+/* Size of the detection picture, 0 if not known */
+static int Pic_Width, Pic_Height;
 
 /* Internal state */
-uint32 Old_Sums[NUMFIELDS_X][NUMFIELDS_Y];
-uint32 Sums[NUMFIELDS_X][NUMFIELDS_Y];
-
-static bool Field_Active[NUMFIELDS_X][NUMFIELDS_Y] = {
-	{1, 1, 1, 1, 1, 1, 1, 1}, 
-	{1, 1, 1, 1, 1, 1, 1, 1}, 
-	{1, 1, 1, 1, 1, 1, 1, 1}, 
-	{1, 1, 1, 1, 1, 1, 1, 1}, 
-	{1, 1, 1, 1, 1, 1, 1, 1}, 
-	{1, 1, 1, 1, 1, 1, 1, 1}, 
-	{1, 1, 1, 1, 1, 1, 1, 1}, 
-	{1, 1, 1, 1, 1, 1, 1, 1} 
-};
-
-uint32 sum(struct OSC_PICTURE *pic, int tile_x, int tile_y) 
+uint32 Sums[MAX_FIELDS];
+
+/* Background model, means in 1/256 grey levels, variances in 1/256 grey 
+ * levels squared. Valid for the configuration Bg_Config. */
+static int32 Bg_Mean[MAX_FIELDS];
+static int32 Bg_Var[MAX_FIELDS];
+static const struct motion_config *Bg_Config;
+static bool Bg_Valid = FALSE;
+
+static struct integral Integral;
+static uint8 Row_Active[OSC_CAM_MAX_IMAGE_HEIGHT];
+
+/* integral_begin
+ * Prepares ii for a w x h picture which is then fed row by row with
+ * integral_addrow(). Only the columns [x0, x1) and the rows y with 
+ * rowactive[y] != 0 (all rows if rowactive is NULL) are summed, the other
+ * pixels count as zero and cost nothing: the table entry of a skipped row 
+ * is an alias of the row above. Sums must stay within the window. 
+ * The table is (re)allocated on demand.
+ */
+void integral_begin(struct integral *ii, int w, int h, int x0, int x1, 
+		const uint8 *rowactive)
+{
+	int cols = x1-x0+1;
+
+	if (cols*(h+1) > ii->size) {
+		free(ii->data);
+		ii->size = cols*(h+1);
+		ii->data = malloc(ii->size * sizeof(uint32));
+		if (ii->data == NULL)
+			fatalerror("Did not get memory\n");
+	}
+	if (h+1 > ii->rowsize) {
+		free(ii->row);
+		ii->rowsize = h+1;
+		ii->row = malloc(ii->rowsize * sizeof(uint32 *));
+		if (ii->row == NULL)
+			fatalerror("Did not get memory\n");
+	}
+	ii->width = w;
+	ii->height = h;
+	ii->x0 = x0;
+	ii->x1 = x1;
+	ii->rowactive = rowactive;
+	ii->rows = 0;
+	ii->used = 1;
+	ii->pixels = 0;
+	memset(ii->data, 0, cols * sizeof(uint32));
+	ii->row[0] = ii->data;
+}
+
+/* integral_addrow
+ * Appends the next picture row. A running row sum is kept and added to 
+ * the entry of the row above, so the row is read exactly once.
+ */
+void integral_addrow(struct integral *ii, const uint8 *row)
+{
+	int x;
+	int cols = ii->x1 - ii->x0;
+	const uint8 *in = row + ii->x0;
+	uint32 *prev = ii->row[ii->rows];
+	uint32 *cur;
+	uint32 rowsum = 0;
+
+	if (ii->rowactive != NULL && !ii->rowactive[ii->rows]) {
+		ii->row[++ii->rows] = prev;
+		return;
+	}
+
+	cur = ii->data + ii->used*(cols+1);
+	cur[0] = 0;
+	for (x=0; x<cols; x++) {
+		rowsum += in[x];
+		cur[x+1] = prev[x+1] + rowsum;
+	}
+	ii->row[++ii->rows] = cur;
+	ii->used++;
+	ii->pixels += cols;
+}
+
+/* integral_build
+ * Builds the summed-area table of pic in one streaming sweep. 
+ */
+void integral_build(struct integral *ii, const struct OSC_PICTURE *pic)
+{
+	int y;
+	const uint8 *row = pic->data;
+
+	integral_begin(ii, pic->width, pic->height, 0, pic->width, NULL);
+	for (y=0; y<pic->height; y++) {
+		integral_addrow(ii, row);
+		row += pic->width;
+	}
+}
+
+/* integral_sum
+ * Sum of the pixels in [fromx, tox) x [fromy, toy), four lookups.
+ */
+uint32 integral_sum(const struct integral *ii, int fromx, int fromy, 
+		int tox, int toy)
+{
+	const uint32 *top = ii->row[fromy] - ii->x0;
+	const uint32 *bottom = ii->row[toy] - ii->x0;
+
+	return bottom[tox] - bottom[fromx] - top[tox] + top[fromx];
+}
+
+uint32 sum(const struct pic_view *v, const struct motion_config *cfg,
+		int tile_x, int tile_y) 
+{
+	int fromx = v->w/cfg->fields_x*tile_x;
+	int fromy = v->h/cfg->fields_y*tile_y;
+	int tox = fromx+v->w/cfg->fields_x;
+	int toy = fromy+v->h/cfg->fields_y;
+
+	return integral_sum(&Integral, fromx, fromy, tox, toy);
+}
+
+/* sum_direct
+ * Same as sum() without an integral image: walks the rows of the tile in
+ * the window v of the picture.
+ */
+uint32 sum_direct(const struct OSC_PICTURE *pic, const struct pic_view *v,
+		const struct motion_config *cfg, int tile_x, int tile_y) 
 {
 	int x, y;
-	uint32 retval=0;
+	int w = v->w/cfg->fields_x;
+	int h = v->h/cfg->fields_y;
+	const uint8 *row = pic_view_row(pic, v, h*tile_y) + w*tile_x;
+	uint32 retval = 0;
+
+	for (y=0; y<h; y++) {
+		for (x=0; x<w; x++) 
+			retval += row[x];
+		row += v->stride;
+	}
+	return retval;
+}
+
+/* mark
+ * Draws corner marks around the tile (tile_x, tile_y) of a fields_x by 
+ * fields_y grid on an output picture. Only 8 short lines are written, the
+ * tile interior is left untouched.
+ */
+void mark(struct OSC_PICTURE *pic, int fields_x, int fields_y, 
+		int tile_x, int tile_y) 
+{
+	int i, k;
+	int bpp = OSC_PICTURE_TYPE_COLOR_DEPTH(pic->type)/8;
+	int stride = pic->width*bpp;
 	uint8 *pix = pic->data;
-	int fromx = pic->width/NUMFIELDS_X*tile_x;
-	int fromy = pic->height/NUMFIELDS_Y*tile_y;
-	int tox = fromx+pic->width/NUMFIELDS_X;
-	int toy = fromy+pic->height/NUMFIELDS_Y;
-
-	for (y=fromy; y<toy; y++) {
-		for (x=fromx; x<tox; x++) {
-			retval += pix[y*pic->width+x];
+	int fromx = pic->width/fields_x*tile_x;
+	int fromy = pic->height/fields_y*tile_y;
+	int tox = fromx+pic->width/fields_x-1;
+	int toy = fromy+pic->height/fields_y-1;
+	int len = min(MARK_LEN, min(tox-fromx, toy-fromy));
+	uint8 *corner[4];
+
+	corner[0] = pix + fromy*stride + fromx*bpp;
+	corner[1] = pix + fromy*stride + tox*bpp;
+	corner[2] = pix + toy*stride + fromx*bpp;
+	corner[3] = pix + toy*stride + tox*bpp;
+
+	for (i=0; i<len; i++) {
+		for (k=0; k<bpp; k++) {
+			/* horizontal arms */
+			corner[0][i*bpp+k] = 255;
+			corner[1][-i*bpp+k] = 255;
+			corner[2][i*bpp+k] = 255;
+			corner[3][-i*bpp+k] = 255;
+			/* vertical arms */
+			corner[0][i*stride+k] = 255;
+			corner[1][i*stride+k] = 255;
+			corner[2][-i*stride+k] = 255;
+			corner[3][-i*stride+k] = 255;
 		}
 	}
-	return retval;
 }
 
-void mark(struct OSC_PICTURE *pic, int tile_x, int tile_y) 
+/*
+ * motion_overlay
+ * Optional render step: marks the changed tiles of res in an output 
+ * picture (greyscale or 24 bit colour), e.g. the debayered stream picture.
+ */
+void motion_overlay(struct OSC_PICTURE *pic, const struct motion_result *res)
 {
 	int x, y;
-	uint8 *pix = pic->data;
-	int fromx = pic->width/NUMFIELDS_X*tile_x;
-	int fromy = pic->height/NUMFIELDS_Y*tile_y;
-	int tox = fromx+pic->width/NUMFIELDS_X;
-	int toy = fromy+pic->height/NUMFIELDS_Y;
 
-	for (y=fromy; y<toy; y++) {
-		pix[fromx+y*pic->width] = 255;
-		pix[tox-1+y*pic->width] = 255;
+	for (y=0; y<res->fields_y; y++) 
+		for (x=0; x<res->fields_x; x++) 
+			if (MOTION_TILE_CHANGED(res, x, y))
+				mark(pic, res->fields_x, res->fields_y, x, y);
+}
+
+/************************************************************************
+ * Configuration							*
+ ************************************************************************/
+
+void motion_config_default(struct motion_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->fields_x = NUMFIELDS_X;
+	cfg->fields_y = NUMFIELDS_Y;
+	cfg->threshold_low = ALARM_THRESHOLD_LOW;
+	cfg->threshold_high = ALARM_THRESHOLD_HIGH;
+	cfg->zscore = ZSCORE_THRESHOLD;
+	cfg->min_deviation = MIN_DEVIATION;
+	cfg->rate_shift = BG_RATE_SHIFT;
+	cfg->fg_rate_shift = BG_FG_RATE_SHIFT;
+	cfg->global_compensation = GLOBAL_COMPENSATION;
+	cfg->first_decision = FIRST_DECISION;
+	cfg->arm_frames = ARM_FRAMES;
+	cfg->hold_frames = HOLD_FRAMES;
+	cfg->clip_pre = CLIP_PRE_FRAMES;
+	cfg->clip_post = CLIP_POST_FRAMES;
+	memset(cfg->active, 1, sizeof(cfg->active));
+}
+
+/*
+ * motion_config
+ * Returns the configuration currently in use.
+ */
+const struct motion_config *motion_config(void)
+{
+	if (Config == NULL) {
+		motion_config_default(&Configs[0]);
+		Config = &Configs[0];
 	}
-	for (x=fromx; x<tox; x++) {
-		pix[x+fromy*pic->width] = 255;
-		pix[x+(toy-1)*pic->width] = 255;
+	return Config;
+}
+
+/*
+ * motion_picture_size
+ * Sets the size of the pictures the detection runs on, the grid of a 
+ * configuration has to give tiles of at least MIN_TILE_SIZE pixels.
+ */
+void motion_picture_size(int width, int height)
+{
+	Pic_Width = width;
+	Pic_Height = height;
+}
+
+/*
+ * motion_config_set
+ * Installs a copy of cfg. Safe to call while the capture loop runs, as 
+ * long as it is not called more than once per frame.
+ *
+ * Return value: -1 if the grid is invalid or too fine for the pictures, the
+ * configuration in use is kept
+ */
+int motion_config_set(const struct motion_config *cfg)
+{
+	struct motion_config *next;
+
+	if (cfg->fields_x < 1 || cfg->fields_x > MAX_FIELDS_X || 
+	    cfg->fields_y < 1 || cfg->fields_y > MAX_FIELDS_Y) {
+		OscLog(ERROR, "Invalid grid size %ix%i\n", cfg->fields_x, 
+		       cfg->fields_y);
+		return -1;
+	}
+	if (Pic_Width > 0 && (Pic_Width/cfg->fields_x < MIN_TILE_SIZE || 
+			      Pic_Height/cfg->fields_y < MIN_TILE_SIZE)) {
+		OscLog(ERROR, "Grid %ix%i too fine for %ix%i pixels\n", 
+		       cfg->fields_x, cfg->fields_y, Pic_Width, Pic_Height);
+		return -1;
+	}
+	next = (Config == &Configs[0]) ? &Configs[1] : &Configs[0];
+	memcpy(next, cfg, sizeof(*next));
+	Config = next;
+	return 0;
+}
+
+/*
+ * inside_polygon
+ * Even-odd rule point in polygon test.
+ */
+static bool inside_polygon(int px, int py, const int *xs, const int *ys, int n)
+{
+	int i, j;
+	bool inside = FALSE;
+
+	for (i=0, j=n-1; i<n; j=i++) {
+		if (((ys[i] > py) != (ys[j] > py)) &&
+		    (px < (xs[j]-xs[i]) * (py-ys[i]) / (ys[j]-ys[i]) + xs[i]))
+			inside = !inside;
 	}
+	return inside;
+}
+
+/*
+ * config_int
+ * Parses the integer setting value into *out if it lies in lo..hi.
+ * Return value: false if it is no number or out of range
+ */
+static bool config_int(const char *value, int lo, int hi, int *out)
+{
+	char *end;
+	long n = strtol(value, &end, 10);
+
+	while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')
+		end++;
+	if (end == value || *end != 0 || n < lo || n > hi)
+		return FALSE;
+	*out = n;
+	return TRUE;
+}
+
+/*
+ * motion_config_load
+ *
+ * Loads a configuration file and installs it with motion_config_set().
+ * The file has one "name=value" setting per line, '#' starts a comment:
+ *
+ * fields=8x8            grid size, at most MAX_FIELDS_X x MAX_FIELDS_Y and
+ *                       tiles of at least MIN_TILE_SIZE pixels, before
+ *                       any mask or polygon line
+ * threshold_low=4       alarm if at least this many active tiles changed ...
+ * threshold_high=48     ... and less than this many
+ * zscore=3              see ZSCORE_THRESHOLD, at most ZSCORE_MAX
+ * min_deviation=3       see MIN_DEVIATION, at most DEVIATION_MAX
+ * rate_shift=5          see BG_RATE_SHIFT, at most RATE_SHIFT_MAX
+ * fg_rate_shift=8       see BG_FG_RATE_SHIFT, at most RATE_SHIFT_MAX
+ * global_compensation=1 see GLOBAL_COMPENSATION
+ * first_decision=0      see FIRST_DECISION
+ * arm_frames=3          see ARM_FRAMES
+ * hold_frames=50        see HOLD_FRAMES
+ * clip_pre=0            see CLIP_PRE_FRAMES, read only at the start
+ * clip_post=20          see CLIP_POST_FRAMES, read only at the start
+ * mask=11110000         one line per tile row from the top, '0' masks a 
+ *                       tile, missing rows and columns stay active
+ * polygon=0,0 1000,0 1000,500 0,500
+ *                       zone in picture coordinates scaled to 1000x1000.
+ *                       If polygons are given, only tiles whose centre 
+ *                       lies in one of them are active (and not masked).
+ *
+ * Settings which are not given keep their default value. On an error, 
+ * e.g. a value out of range, threshold_low above threshold_high, clips 
+ * longer than CLIP_MAX_POOL_FRAMES or a grid after a mask or polygon, the
+ * current configuration is left untouched.
+ *
+ * Return value: 0 on success, -1 otherwise
+ */
+int motion_config_load(const char *filename)
+{
+	static struct motion_config cfg;
+	static int poly_x[MAX_POLYGON_POINTS], poly_y[MAX_POLYGON_POINTS];
+	static uint8 in_zone[MAX_FIELDS];
+	char line[256];
+	char *value, *p;
+	FILE *fp;
+	int lineno = 0;
+	int maskrow = 0;
+	bool has_polygon = FALSE;
+	int n, x, y, i, used;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		OscLog(WARN, "Cannot open motion configuration %s\n", filename);
+		return -1;
+	}
+
+	motion_config_default(&cfg);
+	cfg.threshold_high = -1;
+	memset(in_zone, 0, sizeof(in_zone));
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = 0;
+		if ((value = strchr(line, '=')) == NULL)
+			continue;
+		*value++ = 0;
+		while (*value == ' ' || *value == '\t')
+			value++;
+
+		if (strstr(line, "fields") == line) {
+			/* The masks and polygons are laid out on the grid */
+			if (maskrow > 0 || has_polygon)
+				goto error;
+			if (sscanf(value, "%ix%i", &cfg.fields_x, &cfg.fields_y) != 2 ||
+			    cfg.fields_x < 1 || cfg.fields_x > MAX_FIELDS_X || 
+			    cfg.fields_y < 1 || cfg.fields_y > MAX_FIELDS_Y)
+				goto error;
+		} else if (strstr(line, "threshold_low") == line) {
+			if (!config_int(value, 0, MAX_FIELDS, &cfg.threshold_low))
+				goto error;
+		} else if (strstr(line, "threshold_high") == line) {
+			if (!config_int(value, 0, MAX_FIELDS, &cfg.threshold_high))
+				goto error;
+		} else if (strstr(line, "zscore") == line) {
+			if (!config_int(value, 0, ZSCORE_MAX, &cfg.zscore))
+				goto error;
+		} else if (strstr(line, "min_deviation") == line) {
+			if (!config_int(value, 0, DEVIATION_MAX, &cfg.min_deviation))
+				goto error;
+		} else if (strstr(line, "rate_shift") == line) {
+			if (!config_int(value, 0, RATE_SHIFT_MAX, &cfg.rate_shift))
+				goto error;
+		} else if (strstr(line, "fg_rate_shift") == line) {
+			if (!config_int(value, 0, RATE_SHIFT_MAX, &cfg.fg_rate_shift))
+				goto error;
+		} else if (strstr(line, "global_compensation") == line) {
+			cfg.global_compensation = (atoi(value) != 0);
+		} else if (strstr(line, "first_decision") == line) {
+			cfg.first_decision = (atoi(value) != 0);
+		} else if (strstr(line, "arm_frames") == line) {
+			if (!config_int(value, 0, 1000000, &cfg.arm_frames))
+				goto error;
+		} else if (strstr(line, "hold_frames") == line) {
+			if (!config_int(value, 0, 1000000, &cfg.hold_frames))
+				goto error;
+		} else if (strstr(line, "clip_pre") == line) {
+			if (!config_int(value, 0, CLIP_MAX_POOL_FRAMES, &cfg.clip_pre))
+				goto error;
+		} else if (strstr(line, "clip_post") == line) {
+			if (!config_int(value, 0, CLIP_MAX_POOL_FRAMES, &cfg.clip_post))
+				goto error;
+		} else if (strstr(line, "mask") == line) {
+			if (maskrow >= cfg.fields_y)
+				goto error;
+			for (x=0; value[x] == '0' || value[x] == '1'; x++) 
+				if (x < cfg.fields_x)
+					cfg.active[maskrow*cfg.fields_x+x] = (value[x] == '1');
+			maskrow++;
+		} else if (strstr(line, "polygon") == line) {
+			n = 0;
+			p = value;
+			while (n < MAX_POLYGON_POINTS && 
+			       sscanf(p, "%i,%i%n", &poly_x[n], &poly_y[n], &used) == 2) {
+				p += used;
+				n++;
+			}
+			if (n < 3)
+				goto error;
+			has_polygon = TRUE;
+			for (y=0; y<cfg.fields_y; y++) 
+				for (x=0; x<cfg.fields_x; x++) 
+					if (inside_polygon((2*x+1)*1000/(2*cfg.fields_x),
+							   (2*y+1)*1000/(2*cfg.fields_y),
+							   poly_x, poly_y, n))
+						in_zone[y*cfg.fields_x+x] = 1;
+		} else {
+			OscLog(WARN, "%s:%i: unknown setting %s\n", filename, lineno, line);
+		}
+	}
+	fclose(fp);
+
+	if (cfg.threshold_high < 0)
+		cfg.threshold_high = cfg.fields_x*cfg.fields_y/4*3;
+	if (cfg.threshold_low > cfg.threshold_high) {
+		OscLog(ERROR, "%s: threshold_low above threshold_high\n", filename);
+		return -1;
+	}
+	if (CLIP_POOL_FRAMES(cfg.clip_pre, cfg.clip_post) > CLIP_MAX_POOL_FRAMES) {
+		OscLog(ERROR, "%s: clips too long\n", filename);
+		return -1;
+	}
+	if (has_polygon)
+		for (i=0; i<cfg.fields_x*cfg.fields_y; i++)
+			cfg.active[i] &= in_zone[i];
+
+	return motion_config_set(&cfg);
+
+error:
+	fclose(fp);
+	OscLog(ERROR, "%s:%i: invalid setting %s\n", filename, lineno, line);
+	return -1;
+} /* motion_config_load */
+
+/************************************************************************
+ * Detection								*
+ ************************************************************************/
+
+/*
+ * motion_integral
+ * Prepares the integral image of the detector for a width x height picture
+ * and returns it, the picture rows have to be fed with integral_addrow().
+ * Only the bounding box of the active tiles is summed and rows of tiles 
+ * which are all masked are skipped.
+ */
+struct integral *motion_integral(int width, int height)
+{
+	const struct motion_config *cfg = motion_config();
+	int tw = width/cfg->fields_x;
+	int th = height/cfg->fields_y;
+	int x0 = cfg->fields_x, x1 = 0;
+	int x, y, t;
+	bool rowused;
+
+	memset(Row_Active, 0, sizeof(Row_Active));
+	for (y=0, t=0; y<cfg->fields_y; y++) {
+		rowused = FALSE;
+		for (x=0; x<cfg->fields_x; x++, t++) {
+			if (cfg->active[t]) {
+				rowused = TRUE;
+				x0 = min(x0, x);
+				x1 = max(x1, x+1);
+			}
+		}
+		if (rowused)
+			memset(&Row_Active[y*th], 1, th);
+	}
+	if (x0 >= x1)
+		x0 = x1 = 0;
+
+	integral_begin(&Integral, width, height, x0*tw, x1*tw, Row_Active);
+	Integral.owner = cfg;
+	return &Integral;
+}
+
+/*
+ * decided
+ * Return value: true, if the outcome of the frame does not depend on the 
+ * remaining tiles any more.
+ */
+static bool decided(const struct motion_config *cfg, int changed, int remaining)
+{
+	if (changed >= cfg->threshold_high)
+		return TRUE;
+	if (changed + remaining < cfg->threshold_low)
+		return TRUE;
+	if (changed >= cfg->threshold_low && 
+	    changed + remaining < cfg->threshold_high)
+		return TRUE;
+	return FALSE;
+}
+
+/*
+ * bg_update
+ * Tests the mean grey level norm (in 1/256 grey levels) of tile t against
+ * the background model and updates the model with val. norm is val after
+ * the global illumination compensation (or val without it).
+ * Return value: true, if the tile has changed
+ */
+static bool bg_update(const struct motion_config *cfg, int t, 
+		int32 val, int32 norm)
+{
+	int32 d = val - Bg_Mean[t];
+	int32 d4 = (norm - Bg_Mean[t]) >> (BG_FRAC-4); /* d4*d4 fits */
+	int32 dd = d4*d4;
+	int32 limit;
+	bool changed;
+
+	limit = max(cfg->zscore*cfg->zscore*Bg_Var[t], 
+		(cfg->min_deviation<<4)*(cfg->min_deviation<<4));
+	changed = (dd > limit);
+
+	/* The variance always learns, otherwise a tile with a noise level above
+	 * min_deviation would never leave the changed state */
+	if (changed) 
+		Bg_Mean[t] += d / (1 << cfg->fg_rate_shift);
+	else
+		Bg_Mean[t] += d / (1 << cfg->rate_shift);
+	Bg_Var[t] += (dd - Bg_Var[t]) / (1 << cfg->rate_shift);
+
+	return changed;
+}
+
+/*
+ * global_illumination
+ * Robust estimate of val = gain*mean + offset over all active tiles: the 
+ * gain (in 1/256) is the median of the ratios, the offset the median of
+ * the remaining differences. 
+ */
+static void global_illumination(const struct motion_config *cfg, 
+		const int32 *vals, int32 *gain, int32 *offset)
+{
+	static int32 tmp[MAX_FIELDS];
+	int t, n;
+	int numfields = cfg->fields_x*cfg->fields_y;
+
+	n = 0;
+	for (t=0; t<numfields; t++) 
+		if (cfg->active[t] && Bg_Mean[t] >= (1 << BG_FRAC)) 
+			tmp[n++] = vals[t] * 256 / Bg_Mean[t];
+	*gain = (n > 0) ? median(tmp, n) : 256;
+	/* Limit to 1/4..4, more is no exposure step and would overflow */
+	*gain = max(64, min(*gain, 1024));
+
+	n = 0;
+	for (t=0; t<numfields; t++) 
+		if (cfg->active[t]) 
+			tmp[n++] = vals[t] - ((*gain * Bg_Mean[t]) >> 8);
+	*offset = median(tmp, n);
 }
 
 /* 
- * is_alarm 
+ * detect
+ * Runs the detection on the tiles of pic. The tile sums come from the 
+ * integral image (use_integral) or are summed directly tile by tile, so
+ * that in first decision mode the remaining tiles are not read at all.
  */ 
-bool is_alarm(struct OSC_PICTURE *pic)
+static bool detect(const struct OSC_PICTURE *pic, const struct pic_view *v,
+		struct motion_result *res, bool use_integral, const uint32 *given)
 {
-	int x, y;
+	const struct motion_config *cfg = motion_config();
+	static int32 vals[MAX_FIELDS];
+	int x, y, t;
 	int changed = 0;
-	int numpix;
+	int numpix, numactive = 0, evaluated = 0;
+	uint32 pixels = 0;
+	int32 norm;
+	int32 gain = 256;
+	int32 offset = 0;
+	bool allsums;
 
-	numpix = pic->width/NUMFIELDS_X * pic->height/NUMFIELDS_Y;
-	
-	for (y=0; y<NUMFIELDS_Y; y++) 
-		for (x=0; x<NUMFIELDS_X; x++) {
-			Sums[x][y]=sum(pic, x, y);
-			
-			if (abs(Sums[x][y]-Old_Sums[x][y])/numpix > SENSITIVITY) {
-				if (Field_Active[x][y]) 
-					changed++;
-				mark(pic, x, y);
+	numpix = (v->w/cfg->fields_x) * (v->h/cfg->fields_y);
+
+	if (res != NULL) {
+		memset(res, 0, sizeof(*res));
+		res->fields_x = cfg->fields_x;
+		res->fields_y = cfg->fields_y;
+	}
+	/* Tiles of no pixel, the picture is smaller than the grid */
+	if (numpix == 0)
+		return FALSE;
+
+	if (Bg_Config != cfg) {
+		/* new grid or mask, relearn the background */
+		Bg_Config = cfg;
+		Bg_Valid = FALSE;
+	}
+
+	for (t=0; t<cfg->fields_x*cfg->fields_y; t++)
+		if (cfg->active[t])
+			numactive++;
+
+	/* The illumination estimate and the initialization need all sums */
+	allsums = use_integral || given != NULL || cfg->global_compensation ||
+		!Bg_Valid;
+	if (allsums) {
+		for (y=0, t=0; y<cfg->fields_y; y++) 
+			for (x=0; x<cfg->fields_x; x++, t++) {
+				if (!cfg->active[t])
+					continue;
+				if (use_integral) {
+					Sums[t] = sum(v, cfg, x, y);
+				} else if (given != NULL) {
+					Sums[t] = given[t];
+					pixels += numpix;
+				} else {
+					Sums[t] = sum_direct(pic, v, cfg, x, y);
+					pixels += numpix;
+				}
+				/* Mean grey level in 1/256, split to avoid an overflow */
+				vals[t] = ((Sums[t] / numpix) << BG_FRAC) + 
+					((Sums[t] % numpix) << BG_FRAC) / numpix;
+			}
+	}
+	if (use_integral)
+		pixels = Integral.pixels;
+
+	if (!Bg_Valid) {
+		memcpy(Bg_Mean, vals, sizeof(Bg_Mean));
+		memset(Bg_Var, 0, sizeof(Bg_Var));
+		Bg_Valid = TRUE;
+		if (res != NULL)
+			res->pixels = pixels;
+		return FALSE;
+	}
+
+	if (cfg->global_compensation)
+		global_illumination(cfg, vals, &gain, &offset);
+
+	for (y=0, t=0; y<cfg->fields_y; y++) 
+		for (x=0; x<cfg->fields_x; x++, t++) {
+			if (!cfg->active[t])
+				continue;
+			if (cfg->first_decision && 
+			    decided(cfg, changed, numactive - evaluated))
+				goto done;
+			if (!allsums) {
+				Sums[t] = sum_direct(pic, v, cfg, x, y);
+				pixels += numpix;
+				vals[t] = ((Sums[t] / numpix) << BG_FRAC) + 
+					((Sums[t] % numpix) << BG_FRAC) / numpix;
+			}
+			norm = (vals[t] - offset) * 256 / gain;
+			evaluated++;
+			if (bg_update(cfg, t, vals[t], norm)) {
+				changed++;
+				if (res != NULL)
+					res->tiles[t/32] |= 1u << (t%32);
 			}
 		}
 
-	memcpy(Old_Sums, Sums, sizeof(Sums));
+done:
+	if (res != NULL) {
+		res->changed = changed;
+		res->pixels = pixels;
+		res->evaluated = evaluated;
+	}
 
-	return ((changed >= ALARM_THRESHOLD_LOW) && (changed < ALARM_THRESHOLD_HIGH));
+	return ((changed >= cfg->threshold_low) && (changed < cfg->threshold_high));
 }
+
+/* 
+ * is_alarm 
+ * Runs the motion detection on a greyscale picture (or a raw frame).
+ * The picture itself is never written to; the changed tiles and the 
+ * number of pixels read are reported in res (may be NULL). 
+ */ 
+bool is_alarm(struct OSC_PICTURE *pic, struct motion_result *res)
+{
+	return is_alarm_view(pic, NULL, res);
+}
+
+/* 
+ * is_alarm_view
+ * Same as is_alarm() on the window view of the picture only, which is 
+ * read in place. The tile grid covers the window.
+ */ 
+bool is_alarm_view(const struct OSC_PICTURE *pic, const struct pic_view *view,
+		struct motion_result *res)
+{
+	const struct motion_config *cfg = motion_config();
+	struct integral *ii;
+	struct pic_view v;
+	const uint8 *row;
+	int y;
+
+	pic_view_clip(&v, pic, view);
+	if (cfg->first_decision && !cfg->global_compensation && Bg_Valid && 
+	    Bg_Config == cfg)
+		return detect(pic, &v, res, FALSE, NULL);
+
+	ii = motion_integral(v.w, v.h);
+	row = pic_view_row(pic, &v, 0);
+	for (y=0; y<v.h; y++) {
+		integral_addrow(ii, row);
+		row += v.stride;
+	}
+	return detect(pic, &v, res, TRUE, NULL);
+}
+
+/* 
+ * is_alarm_integral
+ * Same as is_alarm() but the picture has already been fed into the 
+ * integral image returned by motion_integral(), e.g. by fastdebayerBGRGrey().
+ */ 
+bool is_alarm_integral(const struct OSC_PICTURE *pic, struct motion_result *res)
+{
+	struct pic_view v;
+
+	if (Integral.owner != motion_config() || Integral.width != pic->width ||
+	    Integral.height != pic->height || Integral.rows != pic->height) {
+		/* prepared for another configuration, the sums are unknown */
+		if (res != NULL) 
+			memset(res, 0, sizeof(*res));
+		return FALSE;
+	}
+	pic_view_clip(&v, pic, NULL);
+	return detect(pic, &v, res, TRUE, NULL);
+}
+
+/*
+ * motion_sums_rows
+ * Adds the rows y0 to y1-1 of a greyscale picture, or of its window view 
+ * if that is not NULL, to the tile sums of the current configuration, for
+ * the active tiles only. The rows of a frame can be summed in bands, e.g.
+ * on several threads, and the band sums added up for is_alarm_sums().
+ */
+void motion_sums_rows(const struct OSC_PICTURE *pic, 
+		const struct pic_view *view, int y0, int y1, uint32 *sums)
+{
+	const struct motion_config *cfg = motion_config();
+	struct pic_view v;
+	int w, h;
+	const uint8 *row;
+	int x, y, tx, t;
+	uint32 s;
+
+	pic_view_clip(&v, pic, view);
+	w = v.w/cfg->fields_x;
+	h = v.h/cfg->fields_y;
+	if (w == 0 || h == 0)
+		return;
+	y1 = min(y1, h*cfg->fields_y);
+	for (y=y0; y<y1; y++) {
+		row = pic_view_row(pic, &v, y);
+		t = y/h*cfg->fields_x;
+		for (tx=0; tx<cfg->fields_x; tx++, t++, row+=w) {
+			if (!cfg->active[t])
+				continue;
+			for (s=0, x=0; x<w; x++)
+				s += row[x];
+			sums[t] += s;
+		}
+	}
+}
+
+/* 
+ * is_alarm_sums
+ * Same as is_alarm_view() with the tile sums of the picture already taken
+ * by motion_sums_rows().
+ */ 
+bool is_alarm_sums(const struct OSC_PICTURE *pic, const struct pic_view *view,
+		const uint32 *sums, struct motion_result *res)
+{
+	struct pic_view v;
+
+	pic_view_clip(&v, pic, view);
+	return detect(pic, &v, res, FALSE, sums);
+}
+
+/************************************************************************
+ * Alarm events								*
+ ************************************************************************/
+
+/*
+ * alarm_event_update
+ *
+ * Feeds the result of one frame into the alarm event state machine: an
+ * event starts after arm_frames consecutive alarming frames, is held as 
+ * long as alarming frames follow within hold_frames frames and then ends.
+ * Single alarming frames and short bursts therefore produce no event and 
+ * a person walking through produces exactly one.
+ *
+ * Return value: EVENT_* flags. EVENT_PEAK is also reported for frames 
+ * before the start, the picture of the last EVENT_PEAK frame is the one to
+ * keep when the event ends.
+ */
+int alarm_event_update(struct alarm_event *ev, bool alarm, 
+		const struct motion_result *res, uint32 frame, 
+		const struct timeval *now)
+{
+	const struct motion_config *cfg = motion_config();
+	int flags = 0;
+
+	if (alarm) {
+		if (ev->state == ALARM_IDLE) {
+			ev->state = ALARM_PENDING;
+			ev->count = 0;
+			ev->start_frame = frame;
+			ev->start = *now;
+			ev->peak_changed = -1;
+		}
+		if (ev->state == ALARM_HOLD)
+			ev->state = ALARM_ACTIVE;
+		if (ev->state == ALARM_PENDING && ++ev->count >= cfg->arm_frames) {
+			ev->state = ALARM_ACTIVE;
+			ev->number++;
+			flags |= EVENT_START;
+		}
+		ev->end_frame = frame;
+		ev->end = *now;
+		if (res->changed > ev->peak_changed) {
+			ev->peak_changed = res->changed;
+			ev->peak_frame = frame;
+			ev->peak = *now;
+			flags |= EVENT_PEAK;
+		}
+	} else {
+		switch (ev->state) {
+		case ALARM_PENDING:
+			ev->state = ALARM_IDLE;
+			break;
+		case ALARM_ACTIVE:
+			ev->state = ALARM_HOLD;
+			ev->count = 0;
+			/* fall through */
+		case ALARM_HOLD:
+			if (++ev->count >= cfg->hold_frames) {
+				ev->state = ALARM_IDLE;
+				flags |= EVENT_END;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return flags;
+} /* alarm_event_update */
@@ -22,14 +22,163 @@
 #ifndef H_LEANXMOTION
 #define H_LEANXMOTION
 
-/* Configuration of the alarms */
+#include <sys/time.h>
+
+/* Upper limits of the runtime configurable motion grid */
+#define MAX_FIELDS_X 32
+#define MAX_FIELDS_Y 32
+#define MAX_FIELDS (MAX_FIELDS_X*MAX_FIELDS_Y)
+#define MAX_POLYGON_POINTS 16
+/* Smallest tile in pixels of the detection picture, a finer grid is 
+ * rejected, see motion_picture_size() */
+#define MIN_TILE_SIZE 4
+
+/* Default configuration of the alarms, used until a configuration file
+ * has been loaded with motion_config_load() */
 #define NUMFIELDS_X 8
 #define NUMFIELDS_Y 8
 #define NUMFIELDS (NUMFIELDS_X*NUMFIELDS_Y)
 #define ALARM_THRESHOLD_LOW 4
 #define ALARM_THRESHOLD_HIGH (NUMFIELDS/4*3)
-#define SENSITIVITY 3
 
-bool is_alarm(struct OSC_PICTURE *pic);
+/* Background model: every tile keeps an exponential running mean and 
+ * variance of its mean grey level. A tile has changed if its deviation 
+ * from the mean exceeds ZSCORE_THRESHOLD standard deviations, but at least
+ * MIN_DEVIATION grey levels. The model learns with rate 2^-BG_RATE_SHIFT,
+ * the mean of tiles seen as changed only with the slower 
+ * 2^-BG_FG_RATE_SHIFT. */
+#define ZSCORE_THRESHOLD 3
+#define MIN_DEVIATION 3
+#define BG_RATE_SHIFT 5
+#define BG_FG_RATE_SHIFT 8
+
+/* Global illumination compensation: estimate a global gain and offset 
+ * between the current tile means and the background (medians over all 
+ * active tiles) and normalize before differencing, so that exposure and
+ * gain steps of the AEC/AGC do not change every tile at once. */
+#define GLOBAL_COMPENSATION TRUE
+
+/* First decision mode: stop evaluating tiles as soon as the outcome of 
+ * the frame is determined. Tiles which are not evaluated do not update the
+ * background in this frame. */
+#define FIRST_DECISION FALSE
+
+/* Alarm events: an event starts after ARM_FRAMES consecutive alarming 
+ * frames and ends after HOLD_FRAMES frames without alarm */
+#define ARM_FRAMES 3
+#define HOLD_FRAMES 50
+
+/* Runtime configuration of the motion detection, see motion_config_load()
+ * for the file format. */
+struct motion_config {
+	int fields_x;
+	int fields_y;
+	int threshold_low;  /* alarm from this many changed tiles on ... */
+	int threshold_high; /* ... up to one less than this many */
+	int zscore;
+	int min_deviation;
+	int rate_shift;
+	int fg_rate_shift;
+	bool global_compensation;
+	bool first_decision;
+	int arm_frames;
+	int hold_frames;
+	int clip_pre; /* frames of the alarm clips, only read at the start */
+	int clip_post;
+	uint8 active[MAX_FIELDS]; /* tile (x, y) is active[y*fields_x+x] */
+};
+
+void motion_config_default(struct motion_config *cfg);
+const struct motion_config *motion_config(void);
+int motion_config_set(const struct motion_config *cfg);
+void motion_picture_size(int width, int height);
+int motion_config_load(const char *filename);
+
+/* Summed-area table (integral image) of a greyscale picture.
+ * Entry (x, y) holds the sum of all pixels above and left of (x, y), so
+ * there are (width+1)*(height+1) entries and row 0 / column 0 are zero.
+ * Any rectangular sum then costs four lookups. The table may be limited 
+ * to a column window and a subset of the rows, see integral_begin(). */
+struct integral {
+	uint32 *data;
+	uint32 **row; /* row[y] points to the entry of column x0 in row y */
+	int width;
+	int height;
+	int x0, x1; /* column window */
+	const uint8 *rowactive; /* rows to sum, NULL for all */
+	int rows; /* rows fed so far */
+	int used; /* rows stored in data */
+	int size; /* allocated entries */
+	int rowsize; /* allocated row pointers */
+	uint32 pixels; /* pixels summed since integral_begin() */
+	const void *owner; /* set by the user of the table */
+};
+
+void integral_begin(struct integral *ii, int w, int h, int x0, int x1, 
+		const uint8 *rowactive);
+void integral_addrow(struct integral *ii, const uint8 *row);
+void integral_build(struct integral *ii, const struct OSC_PICTURE *pic);
+uint32 integral_sum(const struct integral *ii, int fromx, int fromy, 
+		int tox, int toy);
+
+/* Result of one detection run. Bit y*fields_x+x of tiles is set if the
+ * active tile (x, y) has changed. */
+struct motion_result {
+	int changed; /* number of changed active tiles */
+	int fields_x; /* grid the result refers to */
+	int fields_y;
+	uint32 tiles[MAX_FIELDS/32];
+	uint32 pixels; /* pixels touched for the tile sums of this frame */
+	int evaluated; /* tiles evaluated in this frame */
+};
+
+#define MOTION_TILE_CHANGED(res, x, y) \
+	((res)->tiles[((y)*(res)->fields_x+(x))/32] & \
+	 (1u << (((y)*(res)->fields_x+(x))%32)))
+
+/* State of the alarm event detection, see alarm_event_update() */
+enum alarm_state {
+	ALARM_IDLE,
+	ALARM_PENDING, /* alarming frames, but less than arm_frames yet */
+	ALARM_ACTIVE,
+	ALARM_HOLD /* no alarm since count frames */
+};
+
+struct alarm_event {
+	enum alarm_state state;
+	int count;
+	uint32 number; /* events so far */
+	uint32 start_frame; /* first alarming frame of the event */
+	uint32 end_frame; /* last alarming frame of the event */
+	uint32 peak_frame; /* frame with the most changed tiles */
+	int peak_changed;
+	struct timeval start; /* capture times of the frames above */
+	struct timeval end;
+	struct timeval peak;
+};
+
+/* Flags returned by alarm_event_update() */
+#define EVENT_START 1
+#define EVENT_PEAK 2 /* new peak frame, keep the picture of this frame */
+#define EVENT_END 4
+
+/* Length in pixels of the corner marks drawn by motion_overlay() */
+#define MARK_LEN 4
+
+struct pic_view;
+
+struct integral *motion_integral(int width, int height);
+bool is_alarm(struct OSC_PICTURE *pic, struct motion_result *res);
+bool is_alarm_view(const struct OSC_PICTURE *pic, const struct pic_view *view,
+		struct motion_result *res);
+bool is_alarm_integral(const struct OSC_PICTURE *pic, struct motion_result *res);
+void motion_sums_rows(const struct OSC_PICTURE *pic, 
+		const struct pic_view *view, int y0, int y1, uint32 *sums);
+bool is_alarm_sums(const struct OSC_PICTURE *pic, const struct pic_view *view,
+		const uint32 *sums, struct motion_result *res);
+void motion_overlay(struct OSC_PICTURE *pic, const struct motion_result *res);
+int alarm_event_update(struct alarm_event *ev, bool alarm, 
+		const struct motion_result *res, uint32 frame, 
+		const struct timeval *now);
 
 #endif
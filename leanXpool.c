@@ -0,0 +1,174 @@
+/*	leanXpool.c
+	Copyright (C) 2009 Reto Baettig
+	
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2.1 of the License, or (at
+	your option) any later version.
+	
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+	General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*!@file leanXpool.c
+ * @Band-parallel executor for multicore hosts
+ *
+ * pool_run() splits a frame job into horizontal bands and runs them on a
+ * pool of worker threads and the calling thread. The bands are taken in
+ * order by whichever thread is free; the caller returns when all of them
+ * are done. Which thread ran a band does not matter as long as every band
+ * writes only its own rows and statistics, the caller merges them in band
+ * order afterwards. Without started workers the bands simply run one 
+ * after the other in the caller, as on the single core leanXcam.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "inc/oscar.h"
+#include "leanXtools.h"
+#include "leanXpool.h"
+
+static pthread_t workers[POOL_MAX_THREADS];
+static int numworkers;
+static bool stop;
+
+/* The current job */
+static pool_fn job_fn;
+static void *job_arg;
+static int job_bands;
+static int next_band; /* next band to take */
+static int done_bands;
+static uint32 generation; /* counts the jobs */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+
+/*
+ * run_bands
+ * Takes bands of the current job until none are left. Called and returns
+ * with the lock held.
+ */
+static void run_bands(void)
+{
+	int band;
+
+	while (next_band < job_bands) {
+		band = next_band++;
+		pthread_mutex_unlock(&lock);
+
+		job_fn(job_arg, band, job_bands);
+
+		pthread_mutex_lock(&lock);
+		if (++done_bands == job_bands)
+			pthread_cond_signal(&finished);
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	uint32 seen = 0;
+
+	pthread_mutex_lock(&lock);
+	while (TRUE) {
+		while (generation == seen && !stop)
+			pthread_cond_wait(&wakeup, &lock);
+		if (stop)
+			break;
+		seen = generation;
+		run_bands();
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * pool_start
+ *
+ * Starts threads-1 workers, the thread calling pool_run() is the last one.
+ * threads <= 0 takes one thread per online CPU.
+ *
+ * Return value: the number of threads
+ */
+int pool_start(int threads)
+{
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = max(1, min(threads, POOL_MAX_THREADS));
+
+	stop = FALSE;
+	for (numworkers=0; numworkers<threads-1; numworkers++) {
+		if (pthread_create(&workers[numworkers], NULL, pool_worker, 
+				   NULL) != 0) {
+			OscLog(ERROR, "Could not start a pool worker\n");
+			break;
+		}
+	}
+	return numworkers+1;
+} /* pool_start */
+
+/*
+ * pool_stop
+ *
+ * Stops the workers, pool_run() then runs the bands in the caller.
+ */
+void pool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	stop = TRUE;
+	pthread_cond_broadcast(&wakeup);
+	pthread_mutex_unlock(&lock);
+	for (i=0; i<numworkers; i++)
+		pthread_join(workers[i], NULL);
+	numworkers = 0;
+} /* pool_stop */
+
+/*
+ * pool_threads
+ *
+ * Return value: the number of threads running bands, the caller included
+ */
+int pool_threads(void)
+{
+	return numworkers+1;
+}
+
+/*
+ * pool_run
+ *
+ * Runs fn(arg, band, bands) for every band of bands and returns when all
+ * are done. Only to be called from one thread at a time.
+ */
+void pool_run(pool_fn fn, void *arg, int bands)
+{
+	int band;
+
+	if (numworkers == 0) {
+		for (band=0; band<bands; band++)
+			fn(arg, band, bands);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	job_fn = fn;
+	job_arg = arg;
+	job_bands = bands;
+	next_band = done_bands = 0;
+	generation++;
+	pthread_cond_broadcast(&wakeup);
+
+	run_bands();
+	while (done_bands < job_bands)
+		pthread_cond_wait(&finished, &lock);
+	pthread_mutex_unlock(&lock);
+} /* pool_run */
@@ -0,0 +1,40 @@
+/*	leanXpool.h
+	Copyright (C) 2009 Reto Baettig
+	
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2.1 of the License, or (at
+	your option) any later version.
+	
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser
+	General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*!@file leanXpool.h
+ * @Band-parallel executor for multicore hosts
+ */
+#ifndef H_LEANXPOOL
+#define H_LEANXPOOL
+
+/* Upper limits of the worker threads and of the bands of a frame */
+#define POOL_MAX_THREADS 16
+#define POOL_MAX_BANDS 32
+
+/* First of rows rows in band band of bands, band bands is the end */
+#define BAND_FIRST(rows, band, bands) ((rows)*(band)/(bands))
+
+/* A band job, runs band band of bands of the work described by arg */
+typedef void (*pool_fn)(void *arg, int band, int bands);
+
+int pool_start(int threads);
+void pool_stop(void);
+int pool_threads(void);
+void pool_run(pool_fn fn, void *arg, int bands);
+
+#endif
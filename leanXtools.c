@@ -25,6 +25,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include "inc/oscar.h"
 #include "leanXtools.h"
 
@@ -138,6 +139,139 @@ int ring_peekfrom(struct ringbuf *buf, char *r_ptr, char *data, int maxlen)
 	return retval;
 }
 
+/***************************************************************************/
+/* framepool: reference counted frames, see struct framepool                */
+/***************************************************************************/
+
+/* Frees the frames allocated so far and the bookkeeping */
+static void fpool_free(struct framepool *pool)
+{
+	int i;
+
+	if (pool->mem != NULL)
+		for (i=0; i<pool->nslots; i++)
+			free(pool->mem[i]);
+	free(pool->mem);
+	free(pool->refs);
+	free(pool->items);
+	pool->mem = NULL;
+	pool->refs = NULL;
+	pool->items = NULL;
+}
+
+int fpool_init(struct framepool *pool, int nslots, int slotsize)
+{
+	int i;
+
+	slotsize = (slotsize + FPOOL_ALIGN-1) & ~(FPOOL_ALIGN-1);
+	pool->slotsize = slotsize;
+	pool->nslots = nslots;
+	pool->mem = calloc(nslots, sizeof(char *));
+	pool->refs = calloc(nslots, sizeof(int));
+	pool->items = malloc(nslots*sizeof(struct list));
+	if (!pool->mem || !pool->refs || !pool->items) {
+		fpool_free(pool);
+		return -1;
+	}
+	pool->freelist = NULL;
+	/* The lowest frames are taken first */
+	for (i=nslots-1; i>=0; i--) {
+		pool->mem[i] = malloc(slotsize + FPOOL_ALIGN-1);
+		if (pool->mem[i] == NULL) {
+			fpool_free(pool);
+			return -1;
+		}
+		pool->items[i].data = (char *)(((uintptr_t)pool->mem[i] + 
+			FPOOL_ALIGN-1) & ~(uintptr_t)(FPOOL_ALIGN-1));
+		list_ins(&pool->freelist, &pool->items[i]);
+	}
+	pool->used = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+	return 0;
+}
+
+void fpool_cleanup(struct framepool *pool)
+{
+	pthread_mutex_destroy(&pool->lock);
+	fpool_free(pool);
+}
+
+/* fpool_get
+ *
+ * Takes a free frame, the caller holds its only reference.
+ * Return value: NULL, if all frames are referenced
+ */
+char *fpool_get(struct framepool *pool)
+{
+	struct list *item;
+
+	pthread_mutex_lock(&pool->lock);
+	item = pool->freelist;
+	if (item != NULL) {
+		list_del(&pool->freelist, item);
+		pool->refs[item - pool->items] = 1;
+		pool->used++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return item != NULL ? item->data : NULL;
+}
+
+/* Index of a frame of the pool, -1 if frame is none of its frames */
+static int fpool_slot(struct framepool *pool, const void *frame)
+{
+	int i;
+
+	for (i=0; i<pool->nslots; i++)
+		if (pool->items[i].data == frame)
+			return i;
+	return -1;
+}
+
+/* fpool_ref
+ *
+ * Takes one more reference to a frame which is referenced already.
+ */
+void fpool_ref(struct framepool *pool, const void *frame)
+{
+	const int slot = fpool_slot(pool, frame);
+
+	pthread_mutex_lock(&pool->lock);
+	if (slot < 0 || pool->refs[slot] == 0)
+		OscLog(ERROR, "Frame %p of no pool or not referenced\n", frame);
+	else
+		pool->refs[slot]++;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* fpool_unref
+ *
+ * Drops a reference, the frame is free again without references.
+ */
+void fpool_unref(struct framepool *pool, const void *frame)
+{
+	const int slot = fpool_slot(pool, frame);
+
+	pthread_mutex_lock(&pool->lock);
+	if (slot < 0 || pool->refs[slot] == 0)
+		OscLog(ERROR, "Frame %p of no pool or not referenced\n", frame);
+	else if (--pool->refs[slot] == 0) {
+		list_ins(&pool->freelist, &pool->items[slot]);
+		pool->used--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Return value: the number of referenced frames */
+int fpool_used(struct framepool *pool)
+{
+	int used;
+
+	pthread_mutex_lock(&pool->lock);
+	used = pool->used;
+	pthread_mutex_unlock(&pool->lock);
+	return used;
+}
+
 void list_ins(struct list **head, struct list *item) {
 	item->next = *head;
 	*head=item;
@@ -250,6 +384,70 @@ void flist_cleanup(struct flist *list)
 	}	
 }
 
+/* pic_view_clip
+ *
+ * Returns in v the window win of the picture pic, or the whole picture if
+ * win is NULL. The window is clipped to its stride and to the rows of that
+ * stride in the width*height bytes of the picture, w or h may end up 0.
+ */
+void pic_view_clip(struct pic_view *v, const struct OSC_PICTURE *pic, 
+		const struct pic_view *win)
+{
+	int rows;
+
+	if (win == NULL) {
+		v->x = v->y = 0;
+		v->w = v->stride = pic->width;
+		v->h = pic->height;
+		return;
+	}
+	*v = *win;
+	if (v->stride == 0)
+		v->stride = pic->width;
+	/* Rows of the stride in the frame buffer */
+	rows = pic->width*pic->height/v->stride;
+	v->x = min(v->x, v->stride);
+	v->y = min(v->y, rows);
+	v->w = min(v->w, v->stride - v->x);
+	v->h = min(v->h, rows - v->y);
+} /* pic_view_clip */
+
+/* median
+ *
+ * Returns the median of the n values in a (the upper one for even n).
+ * Uses quickselect, the order of the values in a is changed!
+ */
+int32 median(int32 *a, int n)
+{
+	int lo = 0, hi = n-1, k = n/2;
+	int i, j;
+	int32 pivot, t;
+
+	if (n <= 0)
+		return 0;
+
+	while (lo < hi) {
+		pivot = a[(lo+hi)/2];
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (a[i] < pivot) i++;
+			while (a[j] > pivot) j--;
+			if (i <= j) {
+				t = a[i]; a[i] = a[j]; a[j] = t;
+				i++; j--;
+			}
+		}
+		if (k <= j) 
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else 
+			break;
+	}
+	return a[k];
+} /* median */
+
 /********************************************/
 /* debugging and error tools		    */
 /********************************************/
@@ -22,6 +22,8 @@
 #ifndef H_LEANXTOOLS
 #define H_LEANXTOOLS
 
+#include <pthread.h>
+
 #define min(x1,x2) ((x1) > (x2))? (x2):(x1)
 #define max(x1,x2) ((x1) > (x2))? (x1):(x2)
 
@@ -45,6 +47,26 @@ struct ringbuf {
 	int  size;
 };
 
+/* Pool of preallocated, aligned frames of a fixed size with a reference 
+ * count each. A producer takes a free frame with fpool_get(), every 
+ * consumer which keeps it takes a reference with fpool_ref() and drops it
+ * with fpool_unref(); the frame is free again when the last reference is
+ * gone. Free frames are kept in a list of flist items. Every frame is a 
+ * malloc of its own, there is no large contiguous block to find on the
+ * target without MMU. Thread safe. */
+#define FPOOL_ALIGN 32
+
+struct framepool {
+	char **mem; /* frame i as allocated */
+	int slotsize;
+	int nslots;
+	int *refs;
+	struct list *items; /* one per frame, item i holds frame i, aligned */
+	struct list *freelist; /* head */
+	int used; /* frames with references */
+	pthread_mutex_t lock;
+};
+
 struct flist *flist_init(int maxlen); 
 bool flist_ins(struct flist *list, void *data); 
 bool flist_del(struct flist *list, void *data); 
@@ -64,6 +86,29 @@ int ring_read(struct ringbuf *buf, char *data, int maxlen);
 void ring_addtoptr(struct ringbuf *buf, char **ptr, unsigned int len);
 void ring_subfromptr(struct ringbuf *buf, char **ptr, unsigned int len);
 
+int fpool_init(struct framepool *pool, int nslots, int slotsize);
+void fpool_cleanup(struct framepool *pool);
+char *fpool_get(struct framepool *pool);
+void fpool_ref(struct framepool *pool, const void *frame);
+void fpool_unref(struct framepool *pool, const void *frame);
+int fpool_used(struct framepool *pool);
+
+/* Window of w x h pixels from (x, y) on in a picture whose rows are 
+ * stride pixels apart, so a part of a frame can be processed in place. */
+struct pic_view {
+	uint16 x, y;
+	uint16 w, h;
+	uint16 stride; /* 0 in a requested window: the picture width */
+};
+
+void pic_view_clip(struct pic_view *v, const struct OSC_PICTURE *pic, 
+		const struct pic_view *win);
+/* First pixel of row row of the view v of pic */
+#define pic_view_row(pic, v, row) \
+	((uint8 *)(pic)->data + ((v)->y + (row))*(v)->stride + (v)->x)
+
+int32 median(int32 *a, int n);
+
 void fatalerror(char *strFormat, ...);
 
 void dump_buffer(unsigned char *data, int len);
@@ -1 +1 @@
-cat video.dat | mplayer - -demuxer rawvideo -rawvideo w=376:h=240:format=bgr24:fps=5 -vo x11
+cat ${1:-video.dat} | mplayer - -demuxer rawvideo -rawvideo w=376:h=240:format=${2:-bgr24}:fps=5 -vo x11